@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "util.h"
+#include "vec3.h"
+#include "ray.h"
+#include "interval.h"
+
+typedef struct Aabb {
+    vec3 min, max;
+} Aabb;
+
+static const Aabb aabb_empty = { .min = { INFINITY, INFINITY, INFINITY }, .max = { -INFINITY, -INFINITY, -INFINITY } };
+
+Aabb aabb_union(Aabb a, Aabb b) {
+    return (Aabb) {
+        .min = vec3_min(a.min, b.min),
+        .max = vec3_max(a.max, b.max)
+    };
+}
+
+vec3 aabb_extent(Aabb box) {
+    return vec3_sub(box.max, box.min);
+}
+
+// Clips the ray interval to the box, returns false if nothing is left.
+bool aabb_clip(Aabb box, Ray ray, Interval* ray_t) {
+
+    vec3 inv = vec3_div(vec3_all(1.0), ray.direction);
+
+    double t0 = (box.min.x - ray.origin.x) * inv.x;
+    double t1 = (box.max.x - ray.origin.x) * inv.x;
+    ray_t->min = fmax(ray_t->min, fmin(t0, t1));
+    ray_t->max = fmin(ray_t->max, fmax(t0, t1));
+
+    t0 = (box.min.y - ray.origin.y) * inv.y;
+    t1 = (box.max.y - ray.origin.y) * inv.y;
+    ray_t->min = fmax(ray_t->min, fmin(t0, t1));
+    ray_t->max = fmin(ray_t->max, fmax(t0, t1));
+
+    t0 = (box.min.z - ray.origin.z) * inv.z;
+    t1 = (box.max.z - ray.origin.z) * inv.z;
+    ray_t->min = fmax(ray_t->min, fmin(t0, t1));
+    ray_t->max = fmin(ray_t->max, fmax(t0, t1));
+
+    return ray_t->min <= ray_t->max;
+}
\ No newline at end of file
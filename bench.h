@@ -0,0 +1,90 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "util.h"
+#include "ray.h"
+#include "hit.h"
+#include "scene.h"
+#include "camera.h"
+#include "kernel.h"
+
+typedef struct BenchResult {
+    double build_ms;
+    double trace_ms;
+    int hits;
+    int mismatches;    // Rays whose closest hit differs from the linear scan
+} BenchResult;
+
+BenchResult bench_accel(Scene* scene, SceneAccel accel, const Ray* rays, const double* reference, int count) {
+
+    BenchResult result = { 0 };
+
+    double start = clock_ns();
+    scene_build(scene, accel);
+    result.build_ms = (clock_ns() - start) * 1e-6;
+
+    Hit hit;
+    start = clock_ns();
+    for (int i = 0; i < count; i++) {
+        double t = scene_hit(*scene, rays[i], interval(0.001, INFINITY), &hit) ? hit.t : INFINITY;
+        if (t != INFINITY) {
+            result.hits++;
+        }
+        if (reference != NULL && fabs(t - reference[i]) > 1e-9) {
+            result.mismatches++;
+        }
+    }
+    result.trace_ms = (clock_ns() - start) * 1e-6;
+
+    return result;
+}
+
+// Times building and tracing every acceleration structure against the same
+// rays, half of them camera rays and half diffuse bounces off their hits.
+void bench_scene(Camera* cam, Scene* scene, int count) {
+
+    static const char* const names[] = {
+        [SCENE_ACCEL_LINEAR] = "linear",
+        [SCENE_ACCEL_GRID]   = "grid",
+    };
+
+    camera_init(cam);
+    frand_seed(count);
+    scene_build(scene, SCENE_ACCEL_LINEAR);
+
+    Ray* rays = malloc(count * sizeof(Ray));
+    double* reference = malloc(count * sizeof(double));
+
+    Hit hit;
+    for (int i = 0; i < count; i++) {
+        Ray r = get_ray(cam, frand() * cam->image_width, frand() * cam->image_height);
+        if (i % 2 == 1 && scene_hit(*scene, rays[i - 1], interval(0.001, INFINITY), &hit)) {
+            r.origin = hit.p;
+            r.direction = vec3_add(hit.normal, vec3_rand_unit());
+        }
+        rays[i] = r;
+    }
+
+    for (int accel = SCENE_ACCEL_LINEAR; accel <= SCENE_ACCEL_GRID; accel++) {
+        BenchResult result = bench_accel(scene, accel, rays, (accel == SCENE_ACCEL_LINEAR) ? NULL : reference, count);
+        if (accel == SCENE_ACCEL_LINEAR) {
+            for (int i = 0; i < count; i++) {
+                reference[i] = scene_hit(*scene, rays[i], interval(0.001, INFINITY), &hit) ? hit.t : INFINITY;
+            }
+        }
+        printf("%-8s build %8.3f ms, trace %9.1f ms, %6.2f Mrays/s, %d/%d hits, %d mismatches\n",
+            names[accel], result.build_ms, result.trace_ms, count / (result.trace_ms * 1e3),
+            result.hits, count, result.mismatches);
+    }
+
+    if (scene->accel == SCENE_ACCEL_GRID) {
+        const Grid* grid = scene->grid;
+        printf("grid     %dx%dx%d cells, %d references, %d large\n", grid->res[0], grid->res[1], grid->res[2],
+            grid->cell_start[grid->res[0] * grid->res[1] * grid->res[2]], grid->large_count);
+    }
+
+    free(reference);
+    free(rays);
+}
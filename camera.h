@@ -1,12 +1,15 @@
 #pragma once
 
 #include <stdio.h>
+#include <string.h>
 
 #include "util.h"
 #include "color.h"
-#include "hittable.h"
-#include "material.h"
-#include "scene.h"
+#include "vec3.h"
+#include "ray.h"
+#include "tiles.h"
+#include "denoise.h"
+#include "irradiance.h"
 
 typedef struct Camera {
 
@@ -20,6 +23,18 @@ typedef struct Camera {
     vec3 vup;
     double defocus_angle;
     double focus_dist;   
+    double time;          // Shutter open time
+    double shutter;       // Shutter duration, 0 disables motion blur
+    int thread_count;     // 0 uses every online core
+    int tile_size;        // 0 lets the pilot pass choose
+    TileOrder tile_order;
+    int samples_per_task; // 0 lets the pilot pass choose
+    bool denoise;         // Filter the image guided by the first-hit AOVs
+    DenoiseParams denoise_params;
+    const char* aov_path; // Writes <aov_path>_albedo.ppm, _normal.ppm and _depth.ppm when set
+    bool primary_raster;  // Rasterize primary visibility, for pinhole cameras in sphere-only scenes
+    bool irradiance_cache;  // Interpolate indirect diffuse light, false renders the brute force reference
+    IrradianceParams irradiance_params;
 
     int image_height;    
     vec3 center;         
@@ -43,7 +58,19 @@ Camera camera_default(void) {
         .lookat = (vec3) { 0.0, 0.0, 0.0 },
         .vup = (vec3) { 0.0, 1.0, 0.0 },
         .defocus_angle = 0.0,
-        .focus_dist = 10.0
+        .focus_dist = 10.0,
+        .time = 0.0,
+        .shutter = 0.0,
+        .thread_count = 0,
+        .tile_size = 0,
+        .tile_order = TILE_ORDER_AUTO,
+        .samples_per_task = 0,
+        .denoise = false,
+        .denoise_params = denoise_default(),
+        .aov_path = NULL,
+        .primary_raster = false,
+        .irradiance_cache = false,
+        .irradiance_params = irradiance_default()
     };
 }
 
@@ -103,65 +130,72 @@ vec3 defocus_disk_sample(const Camera* cam) {
     return vec3_add(cam->center, vec3_add(vec3_scale(cam->defocus_disk_u, p.x), vec3_scale(cam->defocus_disk_v, p.y)));
 }
 
-Ray get_ray(const Camera* cam, int i, int j) {
+// Differentials of a camera ray towards the neighbouring pixels, the
+// direction changes by pixel_delta_u and pixel_delta_v before normalizing.
+RayDifferential camera_ray_differential(const Camera* cam, Ray ray) {
+    double len = vec3_len(ray.direction);
+    vec3 d = vec3_scale(ray.direction, 1.0 / len);
+    return (RayDifferential) {
+        .origin_dx = vec3_all(0.0),
+        .origin_dy = vec3_all(0.0),
+        .direction_dx = vec3_scale(vec3_sub(cam->pixel_delta_u, vec3_scale(d, vec3_dot(d, cam->pixel_delta_u))), 1.0 / len),
+        .direction_dy = vec3_scale(vec3_sub(cam->pixel_delta_v, vec3_scale(d, vec3_dot(d, cam->pixel_delta_v))), 1.0 / len)
+    };
+}
 
-    vec3 u = vec3_scale(cam->pixel_delta_u, i);
-    vec3 v = vec3_scale(cam->pixel_delta_v, j);
+uint64_t camera_seed(const Camera* cam, uint64_t a, uint64_t b) {
+    uint64_t time_bits;
+    memcpy(&time_bits, &cam->time, sizeof(time_bits));
+    return (a << 32) ^ b ^ time_bits;
+}
 
-    vec3 pixel_center = vec3_add(cam->pixel00_loc, vec3_add(u, v));
-    vec3 pixel_sample = vec3_add(pixel_center, pixel_sample_square(cam));
+void camera_write_ppm(const Camera* cam, const vec3* pixels, FILE* out) {
 
-    vec3 ray_origin = (cam->defocus_angle <= 0) ? cam->center : defocus_disk_sample(cam);
-    vec3 ray_direction = vec3_sub(pixel_sample, ray_origin);
+    fprintf(out, "P3\n%d %d\n255\n", cam->image_width, cam->image_height);
 
-    return (Ray) {
-        .origin = ray_origin,
-        .direction = ray_direction
-    };
+    for (int j = 0; j < cam->image_height; ++j) {
+        for (int i = 0; i < cam->image_width; ++i) {
+            print_color(out, pixels[j * cam->image_width + i], cam->samples_per_pixel);
+        }
+    }
 }
 
-vec3 ray_color(Ray ray, int depth, Scene scene) {
+// Normals are mapped from [-1, 1] and depth from [0, max depth] to [0, 1], neither is gamma corrected.
+bool camera_write_aovs(const Camera* cam, const Aov* aovs, const char* path) {
 
-    if (depth <= 0) {
-        vec3_all(0.0);
-    }
+    static const char* const suffixes[] = { "albedo", "normal", "depth" };
 
-    Hit hit;
-    
-    if (scene_hit(scene, ray, interval(0.001, INFINITY), &hit)) {
-        vec3 scattered;
-        vec3 attenuation;
-        if (material_scatter(*hit.mat, ray.direction, &hit, &attenuation, &scattered)) {
-            ray.origin = hit.p;
-            ray.direction = scattered;
-            vec3_mul(attenuation, ray_color(ray, depth - 1, scene));
-        }
-        return vec3_all(0.0);
+    int pixel_count = cam->image_width * cam->image_height;
+    double max_depth = 0.0;
+    for (int p = 0; p < pixel_count; p++) {
+        max_depth = fmax(max_depth, aovs[p].depth);
     }
 
-    vec3 unit_direction = vec3_norm(ray.direction);
-    double a = 0.5 * (unit_direction.y + 1.0);
-    static const vec3 background = { 0.5, 0.7, 1.0 };
-    
-    return vec3_add(vec3_all(1.0 - a), vec3_scale(background, a));
-}
+    char name[4096];
 
-void camera_render(Camera* cam, Scene scene) {
-    
-    camera_init(cam);
+    for (int k = 0; k < 3; k++) {
 
-    printf("P3\n%d %d\n255\n", cam->image_width, cam->image_height);
+        snprintf(name, sizeof(name), "%s_%s.ppm", path, suffixes[k]);
+        FILE* out = fopen(name, "w");
+        if (out == NULL) {
+            fprintf(stderr, "Could not open %s\n", name);
+            return false;
+        }
 
-    for (int j = 0; j < cam->image_height; ++j) {
-        for (int i = 0; i < cam->image_width; ++i) {
-            vec3 pixel_color = vec3_all(0.0);
-            for (int sample = 0; sample < cam->samples_per_pixel; ++sample) {
-                Ray r = get_ray(cam, i, j);
-                pixel_color = vec3_add(pixel_color, ray_color(r, cam->max_depth, scene));
+        fprintf(out, "P3\n%d %d\n255\n", cam->image_width, cam->image_height);
+        for (int p = 0; p < pixel_count; p++) {
+            if (k == 0) {
+                print_color(out, aovs[p].albedo, 1);
+                continue;
             }
-            print_color(stdout, pixel_color, cam->samples_per_pixel);
+            vec3 v = (k == 1) ? vec3_scale(vec3_add(aovs[p].normal, vec3_all(1.0)), 0.5)
+                              : vec3_all((max_depth > 0.0) ? aovs[p].depth / max_depth : 0.0);
+            v = vec3_scale(vec3_clamp_all(v, 0.000, 0.999), 256.0);
+            fprintf(out, "%d %d %d\n", (int)v.x, (int)v.y, (int)v.z);
         }
+
+        fclose(out);
     }
 
-    fprintf(stderr, "Done\n");
-}
\ No newline at end of file
+    return true;
+}
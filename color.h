@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stdio.h>
 #include <math.h>
 
 #include "vec3.h"
@@ -12,9 +13,14 @@ vec3 linear_to_gamma(vec3 color) {
     };
 }
 
+// Rec. 709 luminance of a linear color.
+double color_luminance(vec3 color) {
+    return 0.2126 * color.x + 0.7152 * color.y + 0.0722 * color.z;
+}
+
 void print_color(FILE* out, vec3 color, int samples) {
 
-    vec3_scale(color, 1.0 / samples);
+    color = vec3_scale(color, 1.0 / samples);
 
     color = linear_to_gamma(color);
 
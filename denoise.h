@@ -0,0 +1,186 @@
+#pragma once
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "util.h"
+#include "vec3.h"
+#include "color.h"
+#include "parallel.h"
+
+// First-hit features of a pixel, averaged over its samples.
+typedef struct Aov {
+    vec3 albedo;
+    vec3 normal;
+    double depth;      // Distance to the first hit, 0 where the camera ray escaped
+    double luminance;  // First two moments of the samples' luminance, for the noise estimate
+    double luminance_sq;
+} Aov;
+
+typedef struct DenoiseParams {
+    int iterations;       // Each one doubles the filter footprint, 5 covers 61x61 pixels
+    double sigma_color;   // In standard deviations of the pixels' estimated noise
+    double sigma_normal;
+    double sigma_albedo;
+    double sigma_depth;   // Relative to the center pixel's depth
+} DenoiseParams;
+
+DenoiseParams denoise_default(void) {
+    return (DenoiseParams) {
+        .iterations = 5,
+        .sigma_color = 4.0,
+        .sigma_normal = 0.3,
+        .sigma_albedo = 0.1,
+        .sigma_depth = 0.1
+    };
+}
+
+typedef struct DenoiseContext {
+    DenoiseParams params;
+    int width, height;
+    const Aov* aovs;
+    const vec3* in;
+    vec3* out;
+    const double* variance_in;   // Variance of each pixel's filtered color luminance
+    double* variance_out;
+    int step;
+    double inv_normal, inv_albedo, inv_depth;
+    atomic_int next_row;
+} DenoiseContext;
+
+// Variance around a pixel blurred by a 3x3 Gaussian, which steadies the
+// estimate from few samples before it scales the color weights.
+double denoise_variance_blur(const double* variance, int width, int height, int i, int j) {
+
+    static const double kernel[2] = { 0.5, 0.25 };
+
+    double sum = 0.0;
+    double weight_sum = 0.0;
+
+    for (int y = imax(j - 1, 0); y <= imin(j + 1, height - 1); y++) {
+        for (int x = imax(i - 1, 0); x <= imin(i + 1, width - 1); x++) {
+            double w = kernel[abs(x - i)] * kernel[abs(y - j)];
+            sum += w * variance[y * width + x];
+            weight_sum += w;
+        }
+    }
+
+    return sum / weight_sum;
+}
+
+// One edge-avoiding a-trous pass of the B3 spline kernel, guided by the AOVs
+// and, as in SVGF, by luminance differences relative to the estimated noise.
+// The variance is filtered along with the color for the next pass.
+void* denoise_worker(void* arg) {
+
+    static const double kernel[5] = { 1.0 / 16.0, 1.0 / 4.0, 3.0 / 8.0, 1.0 / 4.0, 1.0 / 16.0 };
+
+    DenoiseContext* ctx = arg;
+    int width = ctx->width;
+
+    for (int j = atomic_fetch_add(&ctx->next_row, 1); j < ctx->height; j = atomic_fetch_add(&ctx->next_row, 1)) {
+        for (int i = 0; i < width; i++) {
+
+            int p = j * width + i;
+            double luminance = color_luminance(ctx->in[p]);
+            Aov center = ctx->aovs[p];
+            double inv_depth = ctx->inv_depth / fmax(center.depth, 1e-3);
+            double sigma = ctx->params.sigma_color * sqrt(denoise_variance_blur(ctx->variance_in, width, ctx->height, i, j));
+            double inv_color = 1.0 / (sigma + 1e-6);
+
+            vec3 sum = vec3_all(0.0);
+            double weight_sum = 0.0;
+            double variance_sum = 0.0;
+
+            for (int dy = -2; dy <= 2; dy++) {
+                int y = j + dy * ctx->step;
+                if (y < 0 || y >= ctx->height) {
+                    continue;
+                }
+                for (int dx = -2; dx <= 2; dx++) {
+                    int x = i + dx * ctx->step;
+                    if (x < 0 || x >= width) {
+                        continue;
+                    }
+
+                    int q = y * width + x;
+                    const Aov* other = &ctx->aovs[q];
+
+                    double dc = fabs(color_luminance(ctx->in[q]) - luminance) * inv_color;
+                    double dn = vec3_sqrlen(vec3_sub(other->normal, center.normal)) * ctx->inv_normal;
+                    double da = vec3_sqrlen(vec3_sub(other->albedo, center.albedo)) * ctx->inv_albedo;
+                    double dd = (other->depth - center.depth) * (other->depth - center.depth) * inv_depth * inv_depth;
+
+                    double w = kernel[dx + 2] * kernel[dy + 2] * exp(-(dc + dn + da + dd));
+                    sum = vec3_add(sum, vec3_scale(ctx->in[q], w));
+                    weight_sum += w;
+                    variance_sum += w * w * ctx->variance_in[q];
+                }
+            }
+
+            ctx->out[p] = vec3_scale(sum, 1.0 / weight_sum);
+            ctx->variance_out[p] = variance_sum / (weight_sum * weight_sum);
+        }
+    }
+
+    return NULL;
+}
+
+// Filters the per-sample averaged colors of samples samples each in place.
+// Texture detail is kept by dividing out the albedo before filtering and
+// multiplying it back after.
+void denoise(vec3* colors, const Aov* aovs, int width, int height, int samples, DenoiseParams params, int thread_count) {
+
+    int count = width * height;
+    vec3* a = malloc(count * sizeof(vec3));
+    vec3* b = malloc(count * sizeof(vec3));
+    double* variance_a = malloc(count * sizeof(double));
+    double* variance_b = malloc(count * sizeof(double));
+
+    for (int p = 0; p < count; p++) {
+        double albedo = color_luminance(vec3_max(aovs[p].albedo, vec3_all(1e-3)));
+        a[p] = vec3_div(colors[p], vec3_max(aovs[p].albedo, vec3_all(1e-3)));
+        // Variance of the mean of the samples, carried over to the albedo-divided color.
+        double sample_variance = fmax(aovs[p].luminance_sq - aovs[p].luminance * aovs[p].luminance, 0.0);
+        variance_a[p] = sample_variance / samples / (albedo * albedo);
+    }
+
+    DenoiseContext ctx = {
+        .params = params,
+        .width = width,
+        .height = height,
+        .aovs = aovs,
+        .inv_normal = 1.0 / (params.sigma_normal * params.sigma_normal),
+        .inv_albedo = 1.0 / (params.sigma_albedo * params.sigma_albedo),
+        .inv_depth = 1.0 / params.sigma_depth
+    };
+
+    for (int it = 0; it < params.iterations; it++) {
+
+        ctx.in = a;
+        ctx.out = b;
+        ctx.variance_in = variance_a;
+        ctx.variance_out = variance_b;
+        ctx.step = 1 << it;
+        atomic_store(&ctx.next_row, 0);
+
+        parallel_run(thread_count, denoise_worker, &ctx);
+
+        vec3* t = a;
+        a = b;
+        b = t;
+        double* v = variance_a;
+        variance_a = variance_b;
+        variance_b = v;
+    }
+
+    for (int p = 0; p < count; p++) {
+        colors[p] = vec3_mul(a[p], vec3_max(aovs[p].albedo, vec3_all(1e-3)));
+    }
+
+    free(a);
+    free(b);
+    free(variance_a);
+    free(variance_b);
+}
@@ -0,0 +1,258 @@
+#pragma once
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "util.h"
+#include "vec3.h"
+#include "ray.h"
+#include "aabb.h"
+#include "interval.h"
+#include "hit.h"
+#include "hittable.h"
+
+// Target number of grid cells per bounded hittable.
+#define GRID_DENSITY 3.0
+#define GRID_MAX_RESOLUTION 256
+// Hittables larger than this many times the median size skip the grid.
+#define GRID_LARGE_FACTOR 16.0
+
+typedef struct Grid {
+    Aabb bounds;
+    int res[3];
+    vec3 cell_size;
+    int* cell_start;   // Offsets into cell_items, one past the last cell included
+    int* cell_items;   // Hittable indices
+    int* large;        // Unbounded or oversized hittables, tested by every ray
+    int large_count;
+} Grid;
+
+// Partially sorts values so that values[k] is the k:th smallest, in expected linear time.
+double select_kth(double* values, int count, int k) {
+    int lo = 0;
+    int hi = count - 1;
+    while (lo < hi) {
+        double pivot = values[lo + (hi - lo) / 2];
+        int i = lo;
+        int j = hi;
+        while (i <= j) {
+            while (values[i] < pivot) i++;
+            while (values[j] > pivot) j--;
+            if (i <= j) {
+                double t = values[i];
+                values[i] = values[j];
+                values[j] = t;
+                i++;
+                j--;
+            }
+        }
+        if (k <= j) {
+            hi = j;
+        } else if (k >= i) {
+            lo = i;
+        } else {
+            break;
+        }
+    }
+    return values[k];
+}
+
+void grid_cell_range(const Grid* grid, Aabb box, int lo[3], int hi[3]) {
+    for (int a = 0; a < 3; a++) {
+        double min = vec3_axis(grid->bounds.min, a);
+        double size = vec3_axis(grid->cell_size, a);
+        lo[a] = imin(imax((int)((vec3_axis(box.min, a) - min) / size), 0), grid->res[a] - 1);
+        hi[a] = imin(imax((int)((vec3_axis(box.max, a) - min) / size), 0), grid->res[a] - 1);
+    }
+}
+
+// Bins every bounded hittable into a uniform grid in two linear passes,
+// counting and then filling. Large and unbounded hittables go into a
+// separate list instead so that they don't inflate the grid bounds or the
+// number of cells they occupy. Moving spheres are binned by the box they
+// sweep over the ray times in time, and are unbounded if time is.
+Grid grid_build(const Hittable* hittables, int count, Interval time) {
+
+    Grid grid = {
+        .bounds = aabb_empty,
+        .res = { 0, 0, 0 },
+        .large = malloc(imax(count, 1) * sizeof(int)),
+        .large_count = 0
+    };
+
+    Aabb* boxes = malloc(imax(count, 1) * sizeof(Aabb));
+    bool* bounded = malloc(imax(count, 1) * sizeof(bool));
+    double* sizes = malloc(imax(count, 1) * sizeof(double));
+    int size_count = 0;
+
+    for (int i = 0; i < count; i++) {
+        bounded[i] = hittable_bounds(&hittables[i], time, &boxes[i]);
+        if (bounded[i]) {
+            vec3 e = aabb_extent(boxes[i]);
+            sizes[size_count++] = fmax(e.x, fmax(e.y, e.z));
+        }
+    }
+
+    double median = (size_count > 0) ? select_kth(sizes, size_count, size_count / 2) : 0.0;
+    int small_count = 0;
+
+    for (int i = 0; i < count; i++) {
+        if (bounded[i]) {
+            vec3 e = aabb_extent(boxes[i]);
+            bounded[i] = fmax(e.x, fmax(e.y, e.z)) <= GRID_LARGE_FACTOR * median;
+        }
+        if (bounded[i]) {
+            grid.bounds = aabb_union(grid.bounds, boxes[i]);
+            small_count++;
+        } else {
+            grid.large[grid.large_count++] = i;
+        }
+    }
+
+    if (small_count > 0) {
+
+        vec3 extent = aabb_extent(grid.bounds);
+        double largest = fmax(extent.x, fmax(extent.y, extent.z));
+        extent = vec3_max(extent, vec3_all(largest * 1e-3));
+        double cells_per_unit = cbrt(GRID_DENSITY * small_count / (extent.x * extent.y * extent.z));
+
+        for (int a = 0; a < 3; a++) {
+            grid.res[a] = imin(imax((int)(vec3_axis(extent, a) * cells_per_unit), 1), GRID_MAX_RESOLUTION);
+        }
+        grid.bounds.max = vec3_add(grid.bounds.min, extent);
+        grid.cell_size = vec3_div(extent, (vec3) { grid.res[0], grid.res[1], grid.res[2] });
+    }
+
+    int cell_count = grid.res[0] * grid.res[1] * grid.res[2];
+    grid.cell_start = calloc(cell_count + 1, sizeof(int));
+
+    int lo[3], hi[3];
+
+    for (int i = 0; i < count; i++) {
+        if (!bounded[i]) {
+            continue;
+        }
+        grid_cell_range(&grid, boxes[i], lo, hi);
+        for (int z = lo[2]; z <= hi[2]; z++) {
+            for (int y = lo[1]; y <= hi[1]; y++) {
+                for (int x = lo[0]; x <= hi[0]; x++) {
+                    grid.cell_start[(z * grid.res[1] + y) * grid.res[0] + x + 1]++;
+                }
+            }
+        }
+    }
+
+    for (int c = 0; c < cell_count; c++) {
+        grid.cell_start[c + 1] += grid.cell_start[c];
+    }
+
+    grid.cell_items = malloc(imax(grid.cell_start[cell_count], 1) * sizeof(int));
+    int* fill = malloc(imax(cell_count, 1) * sizeof(int));
+    for (int c = 0; c < cell_count; c++) {
+        fill[c] = grid.cell_start[c];
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (!bounded[i]) {
+            continue;
+        }
+        grid_cell_range(&grid, boxes[i], lo, hi);
+        for (int z = lo[2]; z <= hi[2]; z++) {
+            for (int y = lo[1]; y <= hi[1]; y++) {
+                for (int x = lo[0]; x <= hi[0]; x++) {
+                    grid.cell_items[fill[(z * grid.res[1] + y) * grid.res[0] + x]++] = i;
+                }
+            }
+        }
+    }
+
+    free(fill);
+    free(sizes);
+    free(bounded);
+    free(boxes);
+
+    return grid;
+}
+
+void grid_destroy(Grid grid) {
+    free(grid.cell_start);
+    free(grid.cell_items);
+    free(grid.large);
+}
+
+// Tests the large list first to shorten the ray, then walks the cells the
+// ray passes through with a 3D-DDA until a hit lies inside the current cell.
+FORCE_INLINE bool grid_hit_kernel(const Grid* grid, const Hittable* hittables, const Sphere* spheres, Ray ray, Interval ray_t, Hit* hit, const bool sphere_only) {
+
+    Hit temp;
+    bool hit_anything = false;
+    double closest_so_far = ray_t.max;
+
+    for (int i = 0; i < grid->large_count; i++) {
+        if (hittable_hit_indexed(hittables, spheres, grid->large[i], ray, interval(ray_t.min, closest_so_far), &temp, sphere_only)) {
+            hit_anything = true;
+            closest_so_far = temp.t;
+            *hit = temp;
+        }
+    }
+
+    Interval span = interval(ray_t.min, closest_so_far);
+    if (grid->res[0] == 0 || !aabb_clip(grid->bounds, ray, &span)) {
+        return hit_anything;
+    }
+
+    vec3 entry = ray_at(ray, span.min);
+    int cell[3], step[3];
+    double t_next[3], t_delta[3];
+
+    for (int a = 0; a < 3; a++) {
+        double d = vec3_axis(ray.direction, a);
+        double min = vec3_axis(grid->bounds.min, a);
+        double size = vec3_axis(grid->cell_size, a);
+        cell[a] = imin(imax((int)((vec3_axis(entry, a) - min) / size), 0), grid->res[a] - 1);
+        if (d > 0.0) {
+            step[a] = 1;
+            t_next[a] = (min + (cell[a] + 1) * size - vec3_axis(ray.origin, a)) / d;
+            t_delta[a] = size / d;
+        } else if (d < 0.0) {
+            step[a] = -1;
+            t_next[a] = (min + cell[a] * size - vec3_axis(ray.origin, a)) / d;
+            t_delta[a] = -size / d;
+        } else {
+            step[a] = 0;
+            t_next[a] = INFINITY;
+            t_delta[a] = INFINITY;
+        }
+    }
+
+    while (true) {
+
+        int c = (cell[2] * grid->res[1] + cell[1]) * grid->res[0] + cell[0];
+        for (int k = grid->cell_start[c]; k < grid->cell_start[c + 1]; k++) {
+            if (hittable_hit_indexed(hittables, spheres, grid->cell_items[k], ray, interval(ray_t.min, closest_so_far), &temp, sphere_only)) {
+                hit_anything = true;
+                closest_so_far = temp.t;
+                *hit = temp;
+            }
+        }
+
+        int a = (t_next[0] < t_next[1]) ? ((t_next[0] < t_next[2]) ? 0 : 2) : ((t_next[1] < t_next[2]) ? 1 : 2);
+
+        // Hits beyond this cell may still be beaten by objects in later cells.
+        if (closest_so_far <= t_next[a] || t_next[a] > span.max) {
+            break;
+        }
+
+        cell[a] += step[a];
+        if (cell[a] < 0 || cell[a] >= grid->res[a]) {
+            break;
+        }
+        t_next[a] += t_delta[a];
+    }
+
+    return hit_anything;
+}
+
+bool grid_hit(const Grid* grid, const Hittable* hittables, Ray ray, Interval ray_t, Hit* hit) {
+    return grid_hit_kernel(grid, hittables, NULL, ray, ray_t, hit, false);
+}
@@ -5,12 +5,18 @@
 #include "vec3.h"
 
 typedef struct Material Material;
+typedef struct Hittable Hittable;
 struct Hit {
     vec3 p;
     vec3 normal;
     const Material* mat;
+    const Hittable* hittable;
     double t;
     bool front_face;
+    // Texture coordinates and their derivatives across a pixel, set by
+    // hittable_surface for textured materials only.
+    double u, v;
+    double dudx, dvdx, dudy, dvdy;
 };
 #include "material.h"
 
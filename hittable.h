@@ -7,17 +7,17 @@
 #include "interval.h"
 #include "hit.h"
 #include "ray.h"
+#include "aabb.h"
 
 typedef struct Sphere {
     vec3 center;
     float radius;
-    Material mat;
+    vec3 velocity;  // Units per time unit, zero for static spheres
 } Sphere;
 
 typedef struct Plane {
     vec3 point;
     vec3 normal;
-    Material mat;
 } Plane;
 
 typedef enum HittableType {
@@ -25,15 +25,20 @@ typedef enum HittableType {
     HITTABLE_PLANE
 } HittableType;
 
-typedef struct Hittable {
+struct Hittable {
     HittableType type;
     void* object;
     Material mat;
-} Hittable;
+};
 
-bool hittable_hit_sphere(const Sphere* sphere, Ray ray, Interval ray_t, Hit* hit) {
+vec3 sphere_center(const Sphere* sphere, double time) {
+    return vec3_add(sphere->center, vec3_scale(sphere->velocity, time));
+}
+
+FORCE_INLINE bool sphere_hit_kernel(const Sphere* sphere, Ray ray, Interval ray_t, Hit* hit) {
     
-    vec3 oc = vec3_sub(ray.origin, sphere->center);
+    vec3 center = sphere_center(sphere, ray.time);
+    vec3 oc = vec3_sub(ray.origin, center);
     double a = vec3_sqrlen(ray.direction);
     double half_b = vec3_dot(oc, ray.direction);
     double c = vec3_sqrlen(oc) - sphere->radius * sphere->radius;
@@ -54,22 +59,119 @@ bool hittable_hit_sphere(const Sphere* sphere, Ray ray, Interval ray_t, Hit* hit
 
     hit->t = root;
     hit->p = ray_at(ray, hit->t);
-    vec3 outward_normal = vec3_scale(vec3_sub(hit->p, sphere->center), 1.0 / sphere->radius);
+    vec3 outward_normal = vec3_scale(vec3_sub(hit->p, center), 1.0 / sphere->radius);
     set_face_normal(hit, ray.direction, outward_normal);
 
-    hit->mat = &sphere->mat;
-
     return true;
 }
 
+bool hittable_hit_sphere(const Sphere* sphere, Ray ray, Interval ray_t, Hit* hit) {
+    return sphere_hit_kernel(sphere, ray, ray_t, hit);
+}
+
 bool hittable_hit_plane(const Plane* plane, Ray ray, Interval ray_t, Hit* hit) {
     // ...
     return true;
 }
 
-bool hittable_hit(Hittable hittable, Ray ray, Interval ray_t, Hit* hit) {
-    switch(hittable.type) {
-        case HITTABLE_SPHERE: return hittable_hit_sphere(hittable.object, ray, ray_t, hit);
-        case HITTABLE_PLANE: return hittable_hit_plane(hittable.object, ray, ray_t, hit);
+// Box swept by the sphere over the ray times in time, which must be finite
+// unless the sphere is static. The center moves linearly, so the boxes at
+// both ends of the interval bound it.
+Aabb sphere_bounds(const Sphere* sphere, Interval time) {
+    vec3 r = vec3_all(sphere->radius);
+    if (vec3_nearzero(sphere->velocity)) {
+        return (Aabb) { .min = vec3_sub(sphere->center, r), .max = vec3_add(sphere->center, r) };
     }
+    vec3 c0 = sphere_center(sphere, time.min);
+    vec3 c1 = sphere_center(sphere, time.max);
+    return (Aabb) { .min = vec3_sub(vec3_min(c0, c1), r), .max = vec3_add(vec3_max(c0, c1), r) };
+}
+
+// Bounds the hittable over the ray times in time. Returns false for
+// hittables without a finite bounding box, such as planes, and for moving
+// spheres when time is unbounded.
+bool hittable_bounds(const Hittable* hittable, Interval time, Aabb* box) {
+    switch(hittable->type) {
+        case HITTABLE_SPHERE: {
+            const Sphere* sphere = hittable->object;
+            if (!vec3_nearzero(sphere->velocity) && !(isfinite(time.min) && isfinite(time.max))) {
+                return false;
+            }
+            *box = sphere_bounds(sphere, time);
+            return true;
+        }
+        case HITTABLE_PLANE: return false;
+    }
+    return false;
+}
+
+bool hittable_hit(const Hittable* hittable, Ray ray, Interval ray_t, Hit* hit) {
+    bool hit_anything = false;
+    switch(hittable->type) {
+        case HITTABLE_SPHERE: hit_anything = hittable_hit_sphere(hittable->object, ray, ray_t, hit); break;
+        case HITTABLE_PLANE: hit_anything = hittable_hit_plane(hittable->object, ray, ray_t, hit); break;
+    }
+    if (hit_anything) {
+        hit->mat = &hittable->mat;
+        hit->hittable = hittable;
+    }
+    return hit_anything;
+}
+
+// Tests hittables[i], reading packed spheres directly instead of going
+// through the type switch when sphere_only is set.
+FORCE_INLINE bool hittable_hit_indexed(const Hittable* hittables, const Sphere* spheres, int i, Ray ray, Interval ray_t, Hit* hit, const bool sphere_only) {
+    if (sphere_only) {
+        if (!sphere_hit_kernel(&spheres[i], ray, ray_t, hit)) {
+            return false;
+        }
+        hit->mat = &hittables[i].mat;
+        hit->hittable = &hittables[i];
+        return true;
+    }
+    return hittable_hit(&hittables[i], ray, ray_t, hit);
+}
+
+// Latitude-longitude coordinates of the hit on a sphere, with u running
+// around the y axis and v from the bottom pole to the top. The derivatives
+// solve the pixel footprint of the differential, on the tangent plane, for
+// the change in (u, v) and are zero without a differential.
+void hittable_surface(Hit* hit, Ray ray, const RayDifferential* differential) {
+
+    hit->u = hit->v = 0.0;
+    hit->dudx = hit->dvdx = hit->dudy = hit->dvdy = 0.0;
+
+    if (hit->hittable->type != HITTABLE_SPHERE) {
+        return;
+    }
+
+    const Sphere* sphere = hit->hittable->object;
+    double r = sphere->radius;
+    vec3 d = vec3_scale(vec3_sub(hit->p, sphere_center(sphere, ray.time)), 1.0 / r);
+
+    hit->u = (atan2(-d.z, d.x) + PI) / (2.0 * PI);
+    hit->v = acos(clamp(-d.y, -1.0, 1.0)) / PI;
+
+    double sin_theta = sqrt(d.x * d.x + d.z * d.z);
+    if (differential == NULL || sin_theta < 1e-6) {
+        return;
+    }
+
+    vec3 dpdu = vec3_scale((vec3) { d.z, 0.0, -d.x }, 2.0 * PI * r);
+    vec3 dpdv = vec3_scale((vec3) { -d.y * d.x / sin_theta, sin_theta, -d.y * d.z / sin_theta }, PI * r);
+
+    double a00 = vec3_dot(dpdu, dpdu);
+    double a01 = vec3_dot(dpdu, dpdv);
+    double a11 = vec3_dot(dpdv, dpdv);
+    double det = a00 * a11 - a01 * a01;
+    if (fabs(det) < 1e-12) {
+        return;
+    }
+
+    double bx0 = vec3_dot(dpdu, differential->origin_dx), bx1 = vec3_dot(dpdv, differential->origin_dx);
+    double by0 = vec3_dot(dpdu, differential->origin_dy), by1 = vec3_dot(dpdv, differential->origin_dy);
+    hit->dudx = (a11 * bx0 - a01 * bx1) / det;
+    hit->dvdx = (a00 * bx1 - a01 * bx0) / det;
+    hit->dudy = (a11 * by0 - a01 * by1) / det;
+    hit->dvdy = (a00 * by1 - a01 * by0) / det;
 }
\ No newline at end of file
@@ -0,0 +1,330 @@
+#pragma once
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "util.h"
+#include "vec3.h"
+#include "ray.h"
+#include "hit.h"
+#include "scene.h"
+
+#define IRRADIANCE_BUCKETS (1 << 18)
+// Cell sizes double per level, records go to the level matching their radius.
+#define IRRADIANCE_LEVELS 8
+
+typedef struct IrradianceParams {
+    double accuracy;      // Ward's a, smaller values create more records
+    int strata;           // Gathers strata x (pi * strata) cosine-weighted rays per record
+    double min_spacing;   // Clamps of a record's harmonic mean distance
+    double max_spacing;
+    int bounces;          // Diffuse bounces interpolated from the cache, deeper gathers trace full paths
+} IrradianceParams;
+
+IrradianceParams irradiance_default(void) {
+    return (IrradianceParams) {
+        .accuracy = 0.25,
+        .strata = 6,
+        .min_spacing = 0.05,
+        .max_spacing = 2.0,
+        .bounces = 1
+    };
+}
+
+// Irradiance here is the cosine-weighted average incoming radiance, so a
+// Lambertian surface reflects albedo * irradiance. Gradients hold one
+// vector per color channel.
+typedef struct IrradianceRecord {
+    vec3 p;
+    vec3 n;
+    vec3 irradiance;
+    double radius;        // Harmonic mean distance to the gathered hits
+    vec3 rotation[3];
+    vec3 translation[3];
+} IrradianceRecord;
+
+typedef struct IrradianceBucket {
+    int* records;
+    int count;
+    int capacity;
+} IrradianceBucket;
+
+// Hashed octree of irradiance records, built lazily while rendering. Each
+// record is inserted into the at most 8 cells its validity region overlaps
+// on the finest level whose cells are twice its size, so a lookup only
+// visits the cell holding the query point on every level in use.
+typedef struct IrradianceCache {
+    IrradianceParams params;
+    double cell_size[IRRADIANCE_LEVELS];
+    int level_mask;       // Levels holding any record
+    IrradianceRecord* records;
+    int count;
+    int capacity;
+    IrradianceBucket* buckets;
+    pthread_rwlock_t lock;
+    atomic_int lookups;
+    atomic_int misses;
+} IrradianceCache;
+
+// Radiance along a gather ray of the given level, and the distance to its
+// first non-specular hit or INFINITY if it escaped. Camera paths are level 0.
+typedef vec3 (*IrradianceTrace)(Ray ray, int depth, Scene scene, IrradianceCache* cache, int level, double* distance);
+
+IrradianceCache* irradiance_cache_create(IrradianceParams params) {
+    IrradianceCache* cache = malloc(sizeof(IrradianceCache));
+    *cache = (IrradianceCache) {
+        .params = params,
+        .level_mask = 0,
+        .records = malloc(256 * sizeof(IrradianceRecord)),
+        .count = 0,
+        .capacity = 256,
+        .buckets = calloc(IRRADIANCE_BUCKETS, sizeof(IrradianceBucket))
+    };
+    for (int l = 0; l < IRRADIANCE_LEVELS; l++) {
+        cache->cell_size[l] = 2.0 * params.accuracy * params.min_spacing * (1 << l);
+    }
+    pthread_rwlock_init(&cache->lock, NULL);
+    atomic_store(&cache->lookups, 0);
+    atomic_store(&cache->misses, 0);
+    return cache;
+}
+
+void irradiance_cache_destroy(IrradianceCache* cache) {
+    for (int b = 0; b < IRRADIANCE_BUCKETS; b++) {
+        free(cache->buckets[b].records);
+    }
+    free(cache->buckets);
+    free(cache->records);
+    pthread_rwlock_destroy(&cache->lock);
+    free(cache);
+}
+
+uint32_t irradiance_bucket(int level, int x, int y, int z) {
+    uint32_t h = (uint32_t)x * 73856093u ^ (uint32_t)y * 19349663u ^ (uint32_t)z * 83492791u ^ (uint32_t)level * 2654435761u;
+    return h & (IRRADIANCE_BUCKETS - 1);
+}
+
+// Ward's interpolation with the gradients, returns false if no record is valid at p.
+bool irradiance_cache_lookup(IrradianceCache* cache, vec3 p, vec3 n, vec3* irradiance) {
+
+    double inv_a = 1.0 / cache->params.accuracy;
+    vec3 sum = vec3_all(0.0);
+    double weight_sum = 0.0;
+
+    pthread_rwlock_rdlock(&cache->lock);
+
+    for (int l = 0; l < IRRADIANCE_LEVELS; l++) {
+
+        if (!(cache->level_mask & (1 << l))) {
+            continue;
+        }
+
+        double size = cache->cell_size[l];
+        const IrradianceBucket* bucket = &cache->buckets[irradiance_bucket(l,
+            (int)floor(p.x / size), (int)floor(p.y / size), (int)floor(p.z / size))];
+
+        for (int k = 0; k < bucket->count; k++) {
+
+            const IrradianceRecord* r = &cache->records[bucket->records[k]];
+            vec3 d = vec3_sub(p, r->p);
+
+            // Most records in the cell are too far away, reject them before the square roots.
+            double reach = cache->params.accuracy * r->radius;
+            double ndot = fmin(vec3_dot(n, r->n), 1.0);
+            if (ndot <= 0.0 || vec3_sqrlen(d) >= reach * reach) {
+                continue;
+            }
+
+            double error = vec3_len(d) / r->radius + sqrt(1.0 - ndot);
+            if (error >= cache->params.accuracy) {
+                continue;
+            }
+
+            // Reject records in front of p, they see a different environment.
+            if (vec3_dot(d, vec3_scale(vec3_add(n, r->n), 0.5)) < -0.05 * r->radius) {
+                continue;
+            }
+
+            double w = 1.0 / fmax(error, 1e-6) - inv_a;
+            vec3 axis = vec3_cross(r->n, n);
+            vec3 e = {
+                r->irradiance.x + vec3_dot(axis, r->rotation[0]) + vec3_dot(d, r->translation[0]),
+                r->irradiance.y + vec3_dot(axis, r->rotation[1]) + vec3_dot(d, r->translation[1]),
+                r->irradiance.z + vec3_dot(axis, r->rotation[2]) + vec3_dot(d, r->translation[2])
+            };
+            sum = vec3_add(sum, vec3_scale(vec3_max(e, vec3_all(0.0)), w));
+            weight_sum += w;
+        }
+    }
+
+    pthread_rwlock_unlock(&cache->lock);
+
+    if (weight_sum <= 0.0) {
+        return false;
+    }
+
+    *irradiance = vec3_scale(sum, 1.0 / weight_sum);
+    return true;
+}
+
+void irradiance_cache_insert(IrradianceCache* cache, IrradianceRecord record) {
+
+    pthread_rwlock_wrlock(&cache->lock);
+
+    if (cache->count == cache->capacity) {
+        cache->capacity *= 2;
+        cache->records = realloc(cache->records, cache->capacity * sizeof(IrradianceRecord));
+    }
+    int index = cache->count++;
+    cache->records[index] = record;
+
+    double reach = cache->params.accuracy * record.radius;
+    int level = 0;
+    while (level < IRRADIANCE_LEVELS - 1 && cache->cell_size[level] < 2.0 * reach) {
+        level++;
+    }
+    cache->level_mask |= 1 << level;
+
+    int lo[3], hi[3];
+    for (int a = 0; a < 3; a++) {
+        lo[a] = (int)floor((vec3_axis(record.p, a) - reach) / cache->cell_size[level]);
+        hi[a] = (int)floor((vec3_axis(record.p, a) + reach) / cache->cell_size[level]);
+    }
+
+    for (int z = lo[2]; z <= hi[2]; z++) {
+        for (int y = lo[1]; y <= hi[1]; y++) {
+            for (int x = lo[0]; x <= hi[0]; x++) {
+                IrradianceBucket* bucket = &cache->buckets[irradiance_bucket(level, x, y, z)];
+                if (bucket->count == bucket->capacity) {
+                    bucket->capacity = imax(4, bucket->capacity * 2);
+                    bucket->records = realloc(bucket->records, bucket->capacity * sizeof(int));
+                }
+                bucket->records[bucket->count++] = index;
+            }
+        }
+    }
+
+    pthread_rwlock_unlock(&cache->lock);
+}
+
+// Gathers a new record over the stratified cosine-weighted hemisphere and
+// estimates its gradients from the strata differences (Ward and Heckbert 1992).
+IrradianceRecord irradiance_gather(IrradianceCache* cache, Scene scene, vec3 p, vec3 n, double time, int depth, int level,
+    IrradianceTrace trace) {
+
+    int m = cache->params.strata;
+    int nphi = (int)ceil(PI * m);
+
+    vec3 t = vec3_norm(vec3_cross(fabs(n.x) > 0.5 ? (vec3) { 0.0, 1.0, 0.0 } : (vec3) { 1.0, 0.0, 0.0 }, n));
+    vec3 b = vec3_cross(n, t);
+
+    vec3* radiance = malloc(m * nphi * sizeof(vec3));
+    double* distance = malloc(m * nphi * sizeof(double));
+
+    vec3 sum = vec3_all(0.0);
+    double inv_distance_sum = 0.0;
+
+    for (int k = 0; k < nphi; k++) {
+        for (int j = 0; j < m; j++) {
+            double cos_theta = sqrt(1.0 - (j + frand()) / m);
+            double sin_theta = sqrt(1.0 - cos_theta * cos_theta);
+            double phi = 2.0 * PI * (k + frand()) / nphi;
+            vec3 dir = vec3_add(vec3_scale(n, cos_theta),
+                vec3_add(vec3_scale(t, sin_theta * cos(phi)), vec3_scale(b, sin_theta * sin(phi))));
+
+            Ray ray = { .origin = p, .direction = dir, .time = time };
+            double d;
+            vec3 l = trace(ray, depth, scene, cache, level + 1, &d);
+
+            radiance[k * m + j] = l;
+            distance[k * m + j] = d;
+            sum = vec3_add(sum, l);
+            inv_distance_sum += 1.0 / d;
+        }
+    }
+
+    IrradianceRecord record = {
+        .p = p,
+        .n = n,
+        .irradiance = vec3_scale(sum, 1.0 / (m * nphi)),
+        .radius = clamp((inv_distance_sum > 0.0) ? m * nphi / inv_distance_sum : INFINITY,
+            cache->params.min_spacing, cache->params.max_spacing)
+    };
+
+    for (int c = 0; c < 3; c++) {
+        record.rotation[c] = vec3_all(0.0);
+        record.translation[c] = vec3_all(0.0);
+    }
+
+    for (int k = 0; k < nphi; k++) {
+
+        double phi = 2.0 * PI * (k + 0.5) / nphi;
+        double phi_minus = 2.0 * PI * k / nphi;
+        vec3 u_k = vec3_add(vec3_scale(t, cos(phi)), vec3_scale(b, sin(phi)));
+        vec3 v_k = vec3_add(vec3_scale(t, -sin(phi)), vec3_scale(b, cos(phi)));
+        vec3 v_minus = vec3_add(vec3_scale(t, -sin(phi_minus)), vec3_scale(b, cos(phi_minus)));
+        int k_prev = (k + nphi - 1) % nphi;
+
+        vec3 rot = vec3_all(0.0);
+        vec3 radial = vec3_all(0.0);
+        vec3 tangential = vec3_all(0.0);
+
+        for (int j = 0; j < m; j++) {
+
+            double cos_center = sqrt(1.0 - (j + 0.5) / m);
+            double tan_center = sqrt(1.0 - cos_center * cos_center) / cos_center;
+            double cos_minus = sqrt(1.0 - (double)j / m);
+            double cos_plus = sqrt(1.0 - (j + 1.0) / m);
+            double sin_minus = sqrt(1.0 - cos_minus * cos_minus);
+            double sin_center = sqrt(1.0 - cos_center * cos_center);
+
+            vec3 l = radiance[k * m + j];
+            rot = vec3_add(rot, vec3_scale(l, -tan_center));
+
+            if (j > 0) {
+                double r = fmax(fmin(distance[k * m + j], distance[k * m + j - 1]), cache->params.min_spacing);
+                vec3 dl = vec3_sub(l, radiance[k * m + j - 1]);
+                radial = vec3_add(radial, vec3_scale(dl, sin_minus * cos_minus * cos_minus / r));
+            }
+
+            double r = fmax(fmin(distance[k * m + j], distance[k_prev * m + j]), cache->params.min_spacing);
+            vec3 dl = vec3_sub(l, radiance[k_prev * m + j]);
+            tangential = vec3_add(tangential, vec3_scale(dl, (cos_minus - cos_plus) / (sin_center * r)));
+        }
+
+        // Gradients of E divided by pi, matching the cosine-weighted average.
+        for (int c = 0; c < 3; c++) {
+            record.rotation[c] = vec3_add(record.rotation[c], vec3_scale(v_k, vec3_axis(rot, c) / (m * nphi)));
+            record.translation[c] = vec3_add(record.translation[c], vec3_add(
+                vec3_scale(u_k, vec3_axis(radial, c) * 2.0 / nphi),
+                vec3_scale(v_minus, vec3_axis(tangential, c) / PI)));
+        }
+    }
+
+    free(distance);
+    free(radiance);
+
+    return record;
+}
+
+// Interpolated irradiance at p, hit by a ray of the given level, gathering
+// and inserting a new record when no cached one is valid.
+vec3 irradiance_cache_get(IrradianceCache* cache, Scene scene, vec3 p, vec3 n, double time, int depth, int level,
+    IrradianceTrace trace) {
+
+    vec3 irradiance;
+    atomic_fetch_add(&cache->lookups, 1);
+
+    if (irradiance_cache_lookup(cache, p, n, &irradiance)) {
+        return irradiance;
+    }
+
+    atomic_fetch_add(&cache->misses, 1);
+
+    IrradianceRecord record = irradiance_gather(cache, scene, p, n, time, depth, level, trace);
+    irradiance_cache_insert(cache, record);
+
+    return record.irradiance;
+}
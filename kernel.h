@@ -0,0 +1,279 @@
+#pragma once
+
+#include "util.h"
+#include "vec3.h"
+#include "ray.h"
+#include "hit.h"
+#include "material.h"
+#include "scene.h"
+#include "denoise.h"
+#include "tiles.h"
+#include "camera.h"
+#include "raster.h"
+#include "irradiance.h"
+
+// Render kernels specialized at compile time on the acceleration structure,
+// on whether the scene holds nothing but spheres, on pinhole or thin lens
+// cameras, on a fixed max_depth (0 keeps it a runtime value), on
+// resolving primary rays from the raster pass (sphere-only pinhole) and on
+// looking up indirect diffuse light in the irradiance cache. Every
+// entry instantiates the FORCE_INLINE templates below with constant
+// arguments, so the per-ray checks fold away. Entries are listed most
+// specialized first, camera_render_pixels picks the first one that fits.
+#define RENDER_KERNELS(X) \
+    X(grid_sphere_raster_d4,     SCENE_ACCEL_GRID,   true,  false, 4, true,  false) \
+    X(grid_sphere_raster_d8,     SCENE_ACCEL_GRID,   true,  false, 8, true,  false) \
+    X(grid_sphere_raster_ic,     SCENE_ACCEL_GRID,   true,  false, 0, true,  true)  \
+    X(grid_sphere_raster,        SCENE_ACCEL_GRID,   true,  false, 0, true,  false) \
+    X(grid_sphere_pinhole_d4,    SCENE_ACCEL_GRID,   true,  false, 4, false, false) \
+    X(grid_sphere_thin_lens_d4,  SCENE_ACCEL_GRID,   true,  true,  4, false, false) \
+    X(grid_sphere_pinhole_d8,    SCENE_ACCEL_GRID,   true,  false, 8, false, false) \
+    X(grid_sphere_thin_lens_d8,  SCENE_ACCEL_GRID,   true,  true,  8, false, false) \
+    X(grid_sphere_pinhole_ic,    SCENE_ACCEL_GRID,   true,  false, 0, false, true)  \
+    X(grid_sphere_thin_lens_ic,  SCENE_ACCEL_GRID,   true,  true,  0, false, true)  \
+    X(grid_sphere_pinhole,       SCENE_ACCEL_GRID,   true,  false, 0, false, false) \
+    X(grid_sphere_thin_lens,     SCENE_ACCEL_GRID,   true,  true,  0, false, false) \
+    X(grid_pinhole_ic,           SCENE_ACCEL_GRID,   false, false, 0, false, true)  \
+    X(grid_thin_lens_ic,         SCENE_ACCEL_GRID,   false, true,  0, false, true)  \
+    X(grid_pinhole,              SCENE_ACCEL_GRID,   false, false, 0, false, false) \
+    X(grid_thin_lens,            SCENE_ACCEL_GRID,   false, true,  0, false, false) \
+    X(linear_sphere_raster,      SCENE_ACCEL_LINEAR, true,  false, 0, true,  false) \
+    X(linear_sphere_pinhole,     SCENE_ACCEL_LINEAR, true,  false, 0, false, false) \
+    X(linear_sphere_thin_lens,   SCENE_ACCEL_LINEAR, true,  true,  0, false, false) \
+    X(linear_pinhole_ic,         SCENE_ACCEL_LINEAR, false, false, 0, false, true)  \
+    X(linear_thin_lens_ic,       SCENE_ACCEL_LINEAR, false, true,  0, false, true)  \
+    X(linear_pinhole,            SCENE_ACCEL_LINEAR, false, false, 0, false, false) \
+    X(linear_thin_lens,          SCENE_ACCEL_LINEAR, false, true,  0, false, false)
+
+// Per-frame state the kernels read, only set for the kernels that use it.
+typedef struct FrameData {
+    const PrimaryRaster* raster;
+    IrradianceCache* irradiance;
+} FrameData;
+
+typedef struct RenderKernel {
+    const char* name;
+    SceneAccel accel;
+    bool sphere_only;
+    bool thin_lens;
+    int max_depth;
+    bool primary_raster;
+    bool irradiance_cache;
+    vec3 (*sample)(const Camera* cam, Scene scene, const FrameData* frame, int i, int j, Aov* aov);
+    void (*render_task)(const Camera* cam, Scene scene, const FrameData* frame, const RenderTask* task, vec3* colors, Aov* aovs);
+} RenderKernel;
+
+FORCE_INLINE Ray get_ray_kernel(const Camera* cam, int i, int j, const bool thin_lens) {
+
+    vec3 u = vec3_scale(cam->pixel_delta_u, i);
+    vec3 v = vec3_scale(cam->pixel_delta_v, j);
+
+    vec3 pixel_center = vec3_add(cam->pixel00_loc, vec3_add(u, v));
+    vec3 pixel_sample = vec3_add(pixel_center, pixel_sample_square(cam));
+
+    vec3 ray_origin = thin_lens ? defocus_disk_sample(cam) : cam->center;
+
+    return (Ray) {
+        .origin = ray_origin,
+        .direction = vec3_sub(pixel_sample, ray_origin),
+        .time = cam->time + cam->shutter * frand()
+    };
+}
+
+Ray get_ray(const Camera* cam, int i, int j) {
+    return (cam->defocus_angle > 0) ? get_ray_kernel(cam, i, j, true) : get_ray_kernel(cam, i, j, false);
+}
+
+// Traces a path bounce by bounce, filling aov with the features of its
+// first non-specular hit unless it is NULL. The bounce loop has a constant
+// trip count when max_depth is fixed. Camera rays of pixel (i, j) only test
+// the raster pass's candidates when primary_raster is set. When
+// irradiance_cache is set, paths of the given level end at their first
+// Lambertian hit with the cached irradiance, gathering it with trace on a
+// miss. Camera paths skip their first hit, which the pixel samples average.
+// The differential is only followed in scenes with textures.
+FORCE_INLINE vec3 ray_color_kernel(Ray ray, RayDifferential differential, int depth, Scene scene, Aov* aov, const FrameData* frame, int i, int j,
+    int level, IrradianceTrace trace,
+    const SceneAccel accel, const bool sphere_only, const int max_depth, const bool primary_raster, const bool irradiance_cache) {
+
+    if (max_depth > 0) {
+        depth = max_depth;
+    }
+
+    vec3 throughput = vec3_all(1.0);
+    vec3 aov_throughput = vec3_all(1.0);
+    bool aov_open = aov != NULL;
+
+    if (aov_open) {
+        *aov = (Aov) { .albedo = vec3_all(0.0), .normal = vec3_all(0.0), .depth = 0.0 };
+    }
+
+    for (int bounce = 0; bounce < depth; bounce++) {
+
+        Hit hit;
+
+        bool hit_anything = (primary_raster && bounce == 0)
+            ? raster_hit_kernel(frame->raster, scene, ray, interval(0.001, INFINITY), i, j, frame->raster->gbuffer[j * frame->raster->width + i], &hit, NULL)
+            : scene_hit_kernel(scene, ray, interval(0.001, INFINITY), &hit, accel, sphere_only);
+
+        if (!hit_anything) {
+            vec3 unit_direction = vec3_norm(ray.direction);
+            double a = 0.5 * (unit_direction.y + 1.0);
+            static const vec3 background = { 0.5, 0.7, 1.0 };
+            vec3 sky = vec3_add(vec3_all(1.0 - a), vec3_scale(background, a));
+            if (aov_open) {
+                aov->albedo = vec3_mul(aov_throughput, sky);
+                aov->normal = vec3_all(0.0);
+            }
+            return vec3_mul(throughput, sky);
+        }
+
+        if (scene.textures != NULL) {
+            ray_differential_transfer(&differential, ray, hit.t, hit.normal);
+            if (material_texture(*hit.mat) != NULL) {
+                hittable_surface(&hit, ray, &differential);
+            }
+        }
+
+        if (aov_open) {
+            aov->albedo = vec3_mul(aov_throughput, material_albedo(*hit.mat, &hit));
+            aov->normal = hit.normal;
+            aov->depth += hit.t * vec3_len(ray.direction);
+        }
+
+        if (irradiance_cache && hit.mat->type == MATERIAL_LAMBERTIAN
+            && (bounce > 0 || level > 0) && level < frame->irradiance->params.bounces) {
+            vec3 irradiance = irradiance_cache_get(frame->irradiance, scene, hit.p, hit.normal, ray.time, depth - bounce - 1, level, trace);
+            return vec3_mul(throughput, vec3_mul(material_albedo(*hit.mat, &hit), irradiance));
+        }
+
+        vec3 scattered;
+        vec3 attenuation;
+        if (!material_scatter(*hit.mat, ray.direction, &hit, &attenuation, &scattered)) {
+            return vec3_all(0.0);
+        }
+
+        if (aov_open) {
+            aov_open = material_is_specular(*hit.mat);
+            aov_throughput = vec3_mul(aov_throughput, attenuation);
+        }
+
+        if (scene.textures != NULL) {
+            material_scatter_differential(*hit.mat, &differential, &hit, scattered);
+        }
+
+        throughput = vec3_mul(throughput, attenuation);
+        ray.origin = hit.p;
+        ray.direction = scattered;
+    }
+
+    if (aov_open) {
+        aov->albedo = vec3_all(0.0);
+        aov->normal = vec3_all(0.0);
+    }
+
+    return vec3_all(0.0);
+}
+
+FORCE_INLINE vec3 sample_kernel(const Camera* cam, Scene scene, const FrameData* frame, int i, int j, Aov* aov, IrradianceTrace trace,
+    const SceneAccel accel, const bool sphere_only, const bool thin_lens, const int max_depth, const bool primary_raster, const bool irradiance_cache) {
+    Ray ray = get_ray_kernel(cam, i, j, thin_lens);
+    RayDifferential differential = { 0 };
+    if (scene.textures != NULL) {
+        differential = camera_ray_differential(cam, ray);
+    }
+    return ray_color_kernel(ray, differential, cam->max_depth, scene, aov, frame, i, j, 0, trace,
+        accel, sphere_only, max_depth, primary_raster, irradiance_cache);
+}
+
+// Gather rays start on a surface rather than at the camera and have a runtime depth.
+FORCE_INLINE vec3 gather_kernel(Ray ray, int depth, Scene scene, IrradianceCache* cache, int level, double* distance, IrradianceTrace trace,
+    const SceneAccel accel, const bool sphere_only, const bool irradiance_cache) {
+    FrameData frame = { .raster = NULL, .irradiance = cache };
+    RayDifferential differential = { 0 };
+    if (scene.textures != NULL) {
+        ray_differential_spread(&differential, ray.direction, RAY_DIFFUSE_SPREAD);
+    }
+    Aov aov;
+    vec3 color = ray_color_kernel(ray, differential, depth, scene, &aov, &frame, 0, 0, level, trace,
+        accel, sphere_only, 0, false, irradiance_cache);
+    *distance = (aov.depth > 0.0) ? aov.depth : INFINITY;
+    return color;
+}
+
+// Sums the task's samples of every pixel into colors, and the AOVs into aovs unless it is NULL.
+FORCE_INLINE void render_task_kernel(const Camera* cam, Scene scene, const FrameData* frame, const RenderTask* task, vec3* colors, Aov* aovs,
+    IrradianceTrace trace, const SceneAccel accel, const bool sphere_only, const bool thin_lens, const int max_depth, const bool primary_raster, const bool irradiance_cache) {
+
+    int w = task->x1 - task->x0;
+
+    for (int j = task->y0; j < task->y1; ++j) {
+        for (int i = task->x0; i < task->x1; ++i) {
+
+            vec3 pixel_color = vec3_all(0.0);
+            Aov pixel_aov = { 0 };
+            Aov sample_aov;
+
+            for (int sample = task->sample_begin; sample < task->sample_end; ++sample) {
+                // Seeded per pixel and sample, so the image does not depend on the schedule.
+                frand_seed(camera_seed(cam, j * cam->image_width + i, sample));
+                vec3 color = sample_kernel(cam, scene, frame, i, j, aovs ? &sample_aov : NULL, trace,
+                    accel, sphere_only, thin_lens, max_depth, primary_raster, irradiance_cache);
+                pixel_color = vec3_add(pixel_color, color);
+                if (aovs != NULL) {
+                    double luminance = color_luminance(color);
+                    pixel_aov.albedo = vec3_add(pixel_aov.albedo, sample_aov.albedo);
+                    pixel_aov.normal = vec3_add(pixel_aov.normal, sample_aov.normal);
+                    pixel_aov.depth += sample_aov.depth;
+                    pixel_aov.luminance += luminance;
+                    pixel_aov.luminance_sq += luminance * luminance;
+                }
+            }
+
+            colors[(j - task->y0) * w + (i - task->x0)] = pixel_color;
+            if (aovs != NULL) {
+                aovs[(j - task->y0) * w + (i - task->x0)] = pixel_aov;
+            }
+        }
+    }
+}
+
+#define DEFINE_RENDER_KERNEL(name, accel, sphere_only, thin_lens, max_depth, primary_raster, irradiance_cache) \
+    vec3 gather_##name(Ray ray, int depth, Scene scene, IrradianceCache* cache, int level, double* distance) { \
+        return gather_kernel(ray, depth, scene, cache, level, distance, gather_##name, accel, sphere_only, irradiance_cache); \
+    } \
+    vec3 sample_##name(const Camera* cam, Scene scene, const FrameData* frame, int i, int j, Aov* aov) { \
+        return sample_kernel(cam, scene, frame, i, j, aov, gather_##name, \
+            accel, sphere_only, thin_lens, max_depth, primary_raster, irradiance_cache); \
+    } \
+    void render_task_##name(const Camera* cam, Scene scene, const FrameData* frame, const RenderTask* task, vec3* colors, Aov* aovs) { \
+        render_task_kernel(cam, scene, frame, task, colors, aovs, gather_##name, \
+            accel, sphere_only, thin_lens, max_depth, primary_raster, irradiance_cache); \
+    }
+
+RENDER_KERNELS(DEFINE_RENDER_KERNEL)
+
+#define RENDER_KERNEL_ENTRY(name, accel, sphere_only, thin_lens, max_depth, primary_raster, irradiance_cache) \
+    { #name, accel, sphere_only, thin_lens, max_depth, primary_raster, irradiance_cache, sample_##name, render_task_##name },
+
+static const RenderKernel RENDER_KERNEL_TABLE[] = {
+    RENDER_KERNELS(RENDER_KERNEL_ENTRY)
+};
+
+const RenderKernel* render_kernel_select(const Camera* cam, Scene scene) {
+
+    int count = sizeof(RENDER_KERNEL_TABLE) / sizeof(RENDER_KERNEL_TABLE[0]);
+
+    for (int k = 0; k < count; k++) {
+        const RenderKernel* kernel = &RENDER_KERNEL_TABLE[k];
+        if (kernel->accel != scene.accel) continue;
+        if (kernel->sphere_only && scene.spheres == NULL) continue;
+        if (kernel->thin_lens != (cam->defocus_angle > 0)) continue;
+        if (kernel->max_depth != 0 && kernel->max_depth != cam->max_depth) continue;
+        if (kernel->primary_raster && !cam->primary_raster) continue;
+        if (kernel->irradiance_cache != cam->irradiance_cache) continue;
+        return kernel;
+    }
+
+    return NULL;
+}
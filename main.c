@@ -1,3 +1,8 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
 #include "util.h"
 
 #include "color.h"
@@ -7,12 +12,120 @@
 #include "ray.h"
 #include "hit.h"
 #include "scene.h"
-#include "camera.h"
+#include "render.h"
+#include "sequence.h"
+#include "bench.h"
+#include "ooc.h"
+
+int usage(const char* program) {
+    fprintf(stderr,
+        "Usage: %s [--denoise] [--irradiance] [frames [path_format]]\n"
+        "       %s bench\n"
+        "       %s [--irradiance] room [samples_per_pixel]\n"
+        "       %s texconvert <image.ppm> <texture.tex>\n"
+        "       %s textured <texture.tex>\n"
+        "       %s ooc <scene.ooc> [sphere_count]\n",
+        program, program, program, program, program, program);
+    return 1;
+}
+
+int main(int argc, char** argv) {
+
+    // --denoise anywhere on the command line filters renders with the AOV denoiser,
+    // --irradiance interpolates indirect diffuse light from the irradiance cache.
+    bool denoise = false;
+    bool irradiance = false;
+    int kept = 1;
+    for (int a = 1; a < argc; a++) {
+        if (strcmp(argv[a], "--denoise") == 0) {
+            denoise = true;
+        } else if (strcmp(argv[a], "--irradiance") == 0) {
+            irradiance = true;
+        } else {
+            argv[kept++] = argv[a];
+        }
+    }
+    argc = kept;
+
+    // raytracing texconvert <image.ppm> <texture.tex> writes the tiled, mip-mapped texture format.
+    if (argc > 1 && strcmp(argv[1], "texconvert") == 0) {
+        if (argc != 4) {
+            return usage(argv[0]);
+        }
+        return texture_convert(argv[2], argv[3]) ? 0 : 1;
+    }
+
+    // raytracing room [samples_per_pixel] renders a closed diffuse corner, where
+    // indirect light dominates, to compare the irradiance cache with brute force.
+    if (argc > 1 && strcmp(argv[1], "room") == 0) {
+
+        long samples = 64;
+        if (argc == 3) {
+            char* end;
+            samples = strtol(argv[2], &end, 10);
+            if (end == argv[2] || *end != '\0' || samples < 1 || samples > INT_MAX) {
+                samples = 0;
+            }
+        }
+        if (argc > 3 || samples == 0) {
+            return usage(argv[0]);
+        }
+
+        Scene room = scene_create(8);
+
+        static MaterialLambertian white = { .albedo = { 0.8, 0.8, 0.8 } };
+        static MaterialLambertian red = { .albedo = { 0.8, 0.2, 0.2 } };
+        static MaterialLambertian green = { .albedo = { 0.2, 0.8, 0.2 } };
+
+        // Floor, back wall, red and green side walls and ceiling, then two spheres on the floor.
+        static Sphere room_spheres[] = {
+            { .center = { 0.0, -1000.0, 0.0 }, .radius = 1000.0 },
+            { .center = { 0.0, 0.0, -1003.0 }, .radius = 1000.0 },
+            { .center = { -1003.0, 0.0, 0.0 }, .radius = 1000.0 },
+            { .center = { 1003.0, 0.0, 0.0 }, .radius = 1000.0 },
+            { .center = { 0.0, 1004.0, 0.0 }, .radius = 1000.0 },
+            { .center = { -1.0, 1.0, -1.0 }, .radius = 1.0 },
+            { .center = { 1.2, 0.7, 0.0 }, .radius = 0.7 },
+        };
+        MaterialLambertian* room_materials[] = { &white, &white, &red, &green, &white, &white, &white };
+
+        for (int s = 0; s < 7; s++) {
+            scene_add(&room, (Hittable) {
+                .type = HITTABLE_SPHERE,
+                .mat = { .type = MATERIAL_LAMBERTIAN, .object = room_materials[s] },
+                .object = &room_spheres[s]
+            });
+        }
+        scene_build(&room, SCENE_ACCEL_GRID);
 
-int main() {
+        Camera cam = camera_default();
+
+        cam.aspect_ratio      = 1.0;
+        cam.image_width       = 200;
+        cam.samples_per_pixel = (int)samples;
+        cam.max_depth         = 20;
+        cam.denoise           = denoise;
+        cam.irradiance_cache  = irradiance;
+
+        cam.vfov     = 60.0;
+        cam.lookfrom = (vec3) { 0.0, 2.0, 6.0 };
+        cam.lookat   = (vec3) { 0.0, 1.0, 0.0 };
+        cam.vup      = (vec3) { 0.0, 1.0, 0.0 };
+
+        camera_render(&cam, room);
+        scene_destroy(room);
+        return 0;
+    }
 
     Scene world = scene_create(512);
 
+    // Storage for the randomized spheres, which must outlive the loop below.
+    static Sphere spheres[22 * 22];
+    static MaterialLambertian lambertians[22 * 22];
+    static MaterialMetal metals[22 * 22];
+    static MaterialDielectric dielectrics[22 * 22];
+    int n = 0;
+
     Material ground_material = {
         .type = MATERIAL_LAMBERTIAN,
         .object = &(MaterialLambertian) {
@@ -39,37 +152,42 @@ int main() {
                 Material sphere_material;
                 if (choose_mat < 0.8) {
                     vec3 albedo = vec3_mul(vec3_rand(), vec3_rand());
+                    lambertians[n] = (MaterialLambertian) {
+                        .albedo = albedo
+                    };
                     sphere_material = (Material) {
                         .type = MATERIAL_LAMBERTIAN,
-                        .object = &(MaterialLambertian) {
-                            .albedo = albedo
-                        }
+                        .object = &lambertians[n]
                     };
                 } else if (choose_mat < 0.95) {
                     vec3 albedo = vec3_all(lerp(0.5, 1.0, frand()));
                     double fuzz = frand() * 0.5;
+                    metals[n] = (MaterialMetal) {
+                        .albedo = albedo,
+                        .fuzz = fuzz
+                    };
                     sphere_material = (Material) {
                         .type = MATERIAL_METAL,
-                        .object = &(MaterialMetal) {
-                            .albedo = albedo,
-                            .fuzz = fuzz
-                        }
+                        .object = &metals[n]
                     };
                 } else {
+                    dielectrics[n] = (MaterialDielectric) {
+                        .ir = 1.5
+                    };
                     sphere_material = (Material) {
                         .type = MATERIAL_DIELECTRIC,
-                        .object = &(MaterialDielectric) {
-                            .ir = 1.5
-                        }
+                        .object = &dielectrics[n]
                     };
                 }
+                spheres[n] = (Sphere) {
+                    .center = center, .radius = 0.2
+                };
                 scene_add(&world, (Hittable) {
                     .type = HITTABLE_SPHERE,
                     .mat = sphere_material,
-                    .object = &(Sphere) {
-                        .center = center, .radius = 0.2
-                    }
+                    .object = &spheres[n]
                 });
+                n++;
             }
         }
     }
@@ -129,6 +247,8 @@ int main() {
     cam.image_width       = 1200;
     cam.samples_per_pixel = 10;
     cam.max_depth         = 20;
+    cam.denoise           = denoise;
+    cam.irradiance_cache  = irradiance;
 
     cam.vfov     = 20.0;
     cam.lookfrom = (vec3) { 13.0, 2.0, 3.0 };
@@ -138,5 +258,172 @@ int main() {
     cam.defocus_angle = 0.6;
     cam.focus_dist    = 10.0;
 
+    // raytracing bench compares the acceleration structures on the demo scene.
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        if (argc != 2) {
+            scene_destroy(world);
+            return usage(argv[0]);
+        }
+        bench_scene(&cam, &world, 1 << 18);
+        scene_destroy(world);
+        return 0;
+    }
+
+    // raytracing ooc <scene.ooc> [sphere_count] renders a field of small spheres
+    // paged in from disk, writing the file first when a sphere count is given.
+    if (argc > 1 && strcmp(argv[1], "ooc") == 0) {
+
+        long long count = 0;
+        if (argc == 4) {
+            char* end;
+            count = strtoll(argv[3], &end, 10);
+            if (end == argv[3] || *end != '\0' || count < 1) {
+                count = 0;
+            }
+        }
+        if ((argc != 3 && argc != 4) || (argc == 4 && count == 0)) {
+            scene_destroy(world);
+            return usage(argv[0]);
+        }
+
+        enum { OOC_DIFFUSE = 8, OOC_METAL = 4 };
+        static MaterialLambertian ooc_lambertians[OOC_DIFFUSE];
+        static MaterialMetal ooc_metals[OOC_METAL];
+        Material palette[4 + OOC_DIFFUSE + OOC_METAL] = { ground_material, material1, material2, material3 };
+
+        for (int m = 0; m < OOC_DIFFUSE; m++) {
+            ooc_lambertians[m] = (MaterialLambertian) { .albedo = vec3_mul(vec3_rand(), vec3_rand()) };
+            palette[4 + m] = (Material) { .type = MATERIAL_LAMBERTIAN, .object = &ooc_lambertians[m] };
+        }
+        for (int m = 0; m < OOC_METAL; m++) {
+            ooc_metals[m] = (MaterialMetal) { .albedo = vec3_all(lerp(0.5, 1.0, frand())), .fuzz = frand() * 0.5 };
+            palette[4 + OOC_DIFFUSE + m] = (Material) { .type = MATERIAL_METAL, .object = &ooc_metals[m] };
+        }
+
+        if (count > 0) {
+
+            // Keeps the spheres' share of the ground the same as in the demo.
+            float radius = (float)(0.2 * sqrt(22.0 * 22.0 / (double)count));
+            Aabb field = { .min = { -11.0, 0.0, -11.0 }, .max = { 11.0, 2.0 * radius, 11.0 } };
+
+            OocWriter* writer = ooc_writer_create(argv[2], field, 64 << 20);
+            if (writer == NULL) {
+                scene_destroy(world);
+                return 1;
+            }
+
+            ooc_writer_add(writer, (OocSphere) { .center = { 0.0f, -1000.0f, 0.0f }, .radius = 1000.0f, .material = 0 });
+            ooc_writer_add(writer, (OocSphere) { .center = { 0.0f, 1.0f, 0.0f }, .radius = 1.0f, .material = 1 });
+            ooc_writer_add(writer, (OocSphere) { .center = { -4.0f, 1.0f, 0.0f }, .radius = 1.0f, .material = 2 });
+            ooc_writer_add(writer, (OocSphere) { .center = { 4.0f, 1.0f, 0.0f }, .radius = 1.0f, .material = 3 });
+
+            for (long long s = 0; s < count; s++) {
+                double choose_mat = frand();
+                ooc_writer_add(writer, (OocSphere) {
+                    .center = { (float)(22.0 * frand() - 11.0), radius, (float)(22.0 * frand() - 11.0) },
+                    .radius = radius,
+                    .material = (choose_mat < 0.8) ? 4 + (uint32_t)(frand() * OOC_DIFFUSE)
+                              : (choose_mat < 0.95) ? 4 + OOC_DIFFUSE + (uint32_t)(frand() * OOC_METAL) : 1
+                });
+            }
+
+            if (!ooc_writer_finish(writer)) {
+                scene_destroy(world);
+                return 1;
+            }
+        }
+
+        OocScene* scene = ooc_open(argv[2], palette, sizeof(palette) / sizeof(palette[0]), 16 << 20);
+        if (scene == NULL) {
+            scene_destroy(world);
+            return 1;
+        }
+
+        ooc_render_file(&cam, scene, stdout);
+
+        ooc_close(scene);
+        scene_destroy(world);
+        return 0;
+    }
+
+    // raytracing textured <texture.tex> wraps the texture around the large diffuse and metal spheres.
+    if (argc > 1 && strcmp(argv[1], "textured") == 0) {
+
+        if (argc != 3) {
+            scene_destroy(world);
+            return usage(argv[0]);
+        }
+
+        TextureCache* textures = texture_cache_create(64 << 20);
+        Texture* texture = texture_open(textures, argv[2]);
+        if (texture == NULL) {
+            texture_cache_destroy(textures);
+            scene_destroy(world);
+            return 1;
+        }
+
+        ((MaterialLambertian*)material2.object)->texture = texture;
+        ((MaterialMetal*)material3.object)->texture = texture;
+        ((MaterialLambertian*)material2.object)->albedo = vec3_all(1.0);
+
+        scene_build(&world, SCENE_ACCEL_GRID);
+        camera_render(&cam, world);
+
+        scene_destroy(world);
+        texture_close(texture);
+        texture_cache_destroy(textures);
+        return 0;
+    }
+
+    // raytracing [frames [path_format]] renders a flythrough instead of a single frame to stdout.
+    int frame_count = 0;
+    if (argc > 1) {
+        char* end;
+        long frames = strtol(argv[1], &end, 10);
+        if (argc > 3 || end == argv[1] || *end != '\0' || frames < 1 || frames > INT_MAX) {
+            scene_destroy(world);
+            return usage(argv[0]);
+        }
+        frame_count = (int)frames;
+    }
+
+    // The flythrough's small diffuse spheres rise, so that frames differ in more than the camera.
+    if (frame_count > 0) {
+        for (int h = 0; h < world.size; h++) {
+            Sphere* sphere = world.hittables[h].object;
+            if (sphere >= spheres && sphere < spheres + n && world.hittables[h].mat.type == MATERIAL_LAMBERTIAN) {
+                sphere->velocity = (vec3) { 0.0, 0.25 * frand(), 0.0 };
+            }
+        }
+    }
+
+    scene_build(&world, SCENE_ACCEL_GRID);
+
+    if (frame_count > 0) {
+
+        CameraKeyframe keyframes[] = {
+            { .time = 0.0, .lookfrom = { 13.0, 2.0,  3.0 }, .lookat = vec3_all(0.0), .vfov = 20.0, .focus_dist = 10.0 },
+            { .time = 1.0, .lookfrom = {  3.0, 2.5, 13.0 }, .lookat = vec3_all(0.0), .vfov = 25.0, .focus_dist = 10.0 },
+            { .time = 2.0, .lookfrom = { -9.0, 3.0,  9.0 }, .lookat = (vec3) { -4.0, 1.0, 0.0 }, .vfov = 20.0, .focus_dist = 8.0 },
+        };
+
+        Sequence seq = {
+            .keyframes = keyframes,
+            .keyframe_count = sizeof(keyframes) / sizeof(keyframes[0]),
+            .frame_count = frame_count,
+            .path_format = (argc > 2) ? argv[2] : "frame_%04d.ppm"
+        };
+
+        // A 180 degree shutter, open for half of the interval between frames.
+        if (frame_count > 1) {
+            cam.shutter = 0.5 * (keyframes[seq.keyframe_count - 1].time - keyframes[0].time) / (frame_count - 1);
+        }
+
+        bool ok = camera_render_sequence(&cam, world, seq);
+        scene_destroy(world);
+        return ok ? 0 : 1;
+    }
+
     camera_render(&cam, world);
+    scene_destroy(world);
 }
@@ -2,15 +2,19 @@
 
 #include "util.h"
 #include "vec3.h"
+#include "ray.h"
+#include "texture.h"
 
 
 typedef struct MaterialLambertian {
     vec3 albedo;
+    const Texture* texture;   // Multiplies the albedo when set
 } MaterialLambertian;
 
 typedef struct MaterialMetal {
     vec3 albedo;
     double fuzz;
+    const Texture* texture;   // Multiplies the albedo when set
 } MaterialMetal;
 
 typedef struct MaterialDielectric {
@@ -30,6 +34,13 @@ struct Material {
 };
 #include "hit.h"
 
+vec3 material_textured_albedo(vec3 albedo, const Texture* texture, const Hit* hit) {
+    if (texture == NULL) {
+        return albedo;
+    }
+    return vec3_mul(albedo, texture_sample(texture, hit->u, hit->v, hit->dudx, hit->dvdx, hit->dudy, hit->dvdy));
+}
+
 bool material_scatter_lambertian(const MaterialLambertian* mat, vec3 dir, const Hit* hit, vec3* attenuation, vec3* scattered) {
 
     vec3 scatter_direction = vec3_add(hit->normal, vec3_rand_unit());
@@ -40,7 +51,7 @@ bool material_scatter_lambertian(const MaterialLambertian* mat, vec3 dir, const
 
     *scattered = scatter_direction;
 
-    *attenuation = mat->albedo;
+    *attenuation = material_textured_albedo(mat->albedo, mat->texture, hit);
 
     return true;
 }
@@ -51,7 +62,7 @@ bool material_scatter_metal(const MaterialMetal* mat, vec3 dir, const Hit* hit,
 
     *scattered = vec3_add(reflected, vec3_scale(vec3_rand_sphere(), mat->fuzz));
 
-    *attenuation = mat->albedo;
+    *attenuation = material_textured_albedo(mat->albedo, mat->texture, hit);
 
     return vec3_dot(*scattered, hit->normal) > 0.0;
 }
@@ -86,6 +97,46 @@ bool material_scatter_dielectric(const MaterialDielectric* mat, vec3 dir, const
     return true;
 }
 
+// Reflectance at normal incidence, used as the denoiser's albedo feature.
+vec3 material_albedo(Material mat, const Hit* hit) {
+    switch (mat.type) {
+        case MATERIAL_LAMBERTIAN: {
+            const MaterialLambertian* lambertian = mat.object;
+            return material_textured_albedo(lambertian->albedo, lambertian->texture, hit);
+        }
+        case MATERIAL_METAL: {
+            const MaterialMetal* metal = mat.object;
+            return material_textured_albedo(metal->albedo, metal->texture, hit);
+        }
+        case MATERIAL_DIELECTRIC: return vec3_all(1.0);
+    }
+    return vec3_all(1.0);
+}
+
+// The texture hittable_surface must prepare the hit for, NULL for untextured materials.
+const Texture* material_texture(Material mat) {
+    switch (mat.type) {
+        case MATERIAL_LAMBERTIAN: return ((const MaterialLambertian*)mat.object)->texture;
+        case MATERIAL_METAL: return ((const MaterialMetal*)mat.object)->texture;
+        case MATERIAL_DIELECTRIC: return NULL;
+    }
+    return NULL;
+}
+
+// Carries the differentials of the incoming ray over to the scattered one.
+void material_scatter_differential(Material mat, RayDifferential* rd, const Hit* hit, vec3 scattered) {
+    switch (mat.type) {
+        case MATERIAL_LAMBERTIAN: ray_differential_spread(rd, scattered, RAY_DIFFUSE_SPREAD); break;
+        case MATERIAL_METAL: ray_differential_reflect(rd, hit->normal); break;
+        case MATERIAL_DIELECTRIC: break;
+    }
+}
+
+// Materials whose scattered ray carries the image detail, so the AOVs are taken further down the path.
+bool material_is_specular(Material mat) {
+    return mat.type == MATERIAL_METAL || mat.type == MATERIAL_DIELECTRIC;
+}
+
 bool material_scatter(Material mat, vec3 dir, const Hit* hit, vec3* attenuation, vec3* scattered) {
     switch (mat.type) {
         case MATERIAL_LAMBERTIAN: return material_scatter_lambertian(mat.object, dir, hit, attenuation, scattered);
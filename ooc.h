@@ -0,0 +1,1078 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#include "util.h"
+#include "vec3.h"
+#include "ray.h"
+#include "interval.h"
+#include "aabb.h"
+#include "hit.h"
+#include "hittable.h"
+#include "material.h"
+#include "parallel.h"
+#include "color.h"
+#include "camera.h"
+#include "kernel.h"
+
+// Each leaf cluster fills exactly one page of the system that wrote the
+// file, at least OOC_MIN_PAGE bytes so that files move between systems
+// with smaller pages.
+#define OOC_MIN_PAGE 4096
+#define OOC_MAX_PAGE (1 << 20)
+// Consecutive spheres of a cluster share a box tested before them, as many
+// as fit in the page.
+#define OOC_CLUSTER_GROUPS 16
+// Spheres wider than this fraction of the scene bounds' largest side stay
+// resident and are tested by every ray, like the grid's large list.
+#define OOC_LARGE_FRACTION (1.0 / 16.0)
+// Paths traced together, at most one per pixel so that they never share one.
+#define OOC_BATCH_RAYS (1 << 18)
+#define OOC_NO_MATERIAL UINT32_MAX
+// Bytes a read fault may map around the faulting page, Linux's default fault_around_bytes.
+#define OOC_FAULT_AROUND_BYTES (64 << 10)
+
+static const char OOC_MAGIC[8] = "RTOOC03";
+
+// Sphere as stored in the scene file, material indexes the palette given to ooc_open.
+typedef struct OocSphere {
+    float center[3];
+    float radius;
+    uint32_t material;
+} OocSphere;
+
+typedef struct OocBox {
+    float min[3], max[3];
+} OocBox;
+
+typedef struct OocCluster {
+    int32_t count;
+    int32_t reserved[3];
+    OocBox groups[OOC_CLUSTER_GROUPS];   // Bounds of spheres [g * group_size, (g + 1) * group_size)
+    OocSphere spheres[];                 // OOC_CLUSTER_GROUPS * group_size fit in the page
+} OocCluster;
+
+// Resident node of the top levels, each leaf references one cluster.
+typedef struct OocNode {
+    OocBox bounds;
+    int32_t child;     // First of two consecutive children, -1 for leaves
+    int32_t cluster;   // -1 for internal nodes
+} OocNode;
+
+// File layout written by OocWriter: this header padded to a page, the
+// clusters in Morton order with one page each, the nodes with the root
+// first and children after their parents, then the large spheres.
+typedef struct OocHeader {
+    char magic[8];
+    int32_t page_size;
+    int32_t reserved;
+    int64_t sphere_count;
+    int32_t cluster_count;
+    int32_t node_count;
+    int64_t node_offset;
+    int64_t large_count;
+    int64_t large_offset;
+} OocHeader;
+
+// Geometry whose clusters are paged in from a memory-mapped file on
+// demand. Only the nodes, the large spheres and one stamp per cluster stay
+// in memory, and clusters are dropped again least recently used first once
+// more than resident_limit of them have been touched.
+typedef struct OocScene {
+    int fd;
+    const uint8_t* clusters;   // Mapping of every cluster page
+    size_t mapped_bytes;
+    size_t page_size;
+    int group_size;
+    int fault_around;          // Clusters a fault may map at once
+    int32_t cluster_count;
+    int64_t sphere_count;
+    OocNode* nodes;
+    int32_t node_count;
+    int stack_size;            // Traversal stack entries a ray needs
+    OocSphere* large;
+    int64_t large_count;
+    const Material* materials;
+    uint32_t material_count;
+    atomic_int* stamps;        // Round a cluster was last visited in, 0 while it is not resident
+    atomic_long resident_count;
+    long resident_limit;
+    atomic_llong loads;
+    long long evictions;
+    long long queued;
+    int rounds;
+} OocScene;
+
+uint64_t ooc_spread_bits(uint64_t x) {
+    x &= 0x1FFFFF;
+    x = (x | x << 32) & 0x1F00000000FFFFull;
+    x = (x | x << 16) & 0x1F0000FF0000FFull;
+    x = (x | x << 8) & 0x100F00F00F00F00Full;
+    x = (x | x << 4) & 0x10C30C30C30C30C3ull;
+    x = (x | x << 2) & 0x1249249249249249ull;
+    return x;
+}
+
+// Page size files written on this system use.
+size_t ooc_page_size(void) {
+    long page = sysconf(_SC_PAGESIZE);
+    return (page > OOC_MIN_PAGE) ? (size_t)page : OOC_MIN_PAGE;
+}
+
+int ooc_group_size(size_t page_size) {
+    return (int)((page_size - sizeof(OocCluster)) / (OOC_CLUSTER_GROUPS * sizeof(OocSphere)));
+}
+
+Aabb ooc_sphere_bounds(const OocSphere* sphere) {
+    vec3 c = { sphere->center[0], sphere->center[1], sphere->center[2] };
+    vec3 r = vec3_all(sphere->radius);
+    return (Aabb) { .min = vec3_sub(c, r), .max = vec3_add(c, r) };
+}
+
+// Rounds outwards so that the float box still contains the double one.
+OocBox ooc_box(Aabb box) {
+    OocBox out;
+    for (int a = 0; a < 3; a++) {
+        float min = (float)vec3_axis(box.min, a);
+        float max = (float)vec3_axis(box.max, a);
+        out.min[a] = (min > vec3_axis(box.min, a)) ? nextafterf(min, -INFINITY) : min;
+        out.max[a] = (max < vec3_axis(box.max, a)) ? nextafterf(max, INFINITY) : max;
+    }
+    return out;
+}
+
+// Slab test against a stored box for a ray whose inverse direction the
+// caller computed once for all the boxes it tests.
+FORCE_INLINE bool ooc_box_hit(const OocBox* box, vec3 origin, vec3 inv, double t_min, double t_max) {
+    for (int a = 0; a < 3; a++) {
+        double o = vec3_axis(origin, a);
+        double i = vec3_axis(inv, a);
+        double t0 = (box->min[a] - o) * i;
+        double t1 = (box->max[a] - o) * i;
+        // Comparisons rather than fmin and fmax, which are calls without -ffast-math.
+        if (t0 > t1) {
+            double t = t0;
+            t0 = t1;
+            t1 = t;
+        }
+        t_min = (t0 > t_min) ? t0 : t_min;
+        t_max = (t1 < t_max) ? t1 : t_max;
+    }
+    return t_min <= t_max;
+}
+
+// Splits the Morton ordered clusters [lo, hi) in halves below node.
+Aabb ooc_build_nodes(OocNode* nodes, int32_t* node_count, const Aabb* bounds, int32_t node, int32_t lo, int32_t hi) {
+
+    Aabb box;
+
+    if (hi - lo == 1) {
+        nodes[node].child = -1;
+        nodes[node].cluster = lo;
+        box = bounds[lo];
+    } else {
+        int32_t child = *node_count;
+        *node_count += 2;
+        int32_t mid = lo + (hi - lo) / 2;
+        nodes[node].child = child;
+        nodes[node].cluster = -1;
+        box = aabb_union(ooc_build_nodes(nodes, node_count, bounds, child, lo, mid),
+                         ooc_build_nodes(nodes, node_count, bounds, child + 1, mid, hi));
+    }
+
+    nodes[node].bounds = ooc_box(box);
+    return box;
+}
+
+// Sphere with its position along the Morton curve, the unit of the external sort.
+typedef struct OocRecord {
+    uint64_t code;
+    OocSphere sphere;
+} OocRecord;
+
+int ooc_record_compare(const void* a, const void* b) {
+    uint64_t x = ((const OocRecord*)a)->code;
+    uint64_t y = ((const OocRecord*)b)->code;
+    return (x > y) - (x < y);
+}
+
+// Writes a scene file from a stream of spheres without holding them in
+// memory. Spheres are sorted along a Morton curve over the given bounds in
+// runs of at most memory_bytes, which spill to temporary files and are
+// merged into clusters by ooc_writer_finish.
+typedef struct OocWriter {
+    const char* path;
+    FILE* out;
+    size_t page_size;
+    int group_size;
+    uint8_t* page;             // Cluster being written
+    Aabb bounds;               // Spheres outside are clamped to the border of the curve
+    vec3 scale;
+    double large_size;
+    OocRecord* buffer;
+    size_t buffer_count;
+    size_t buffer_capacity;
+    FILE** runs;
+    int run_count;
+    OocSphere* large;
+    int64_t large_count;
+    int64_t large_capacity;
+    int64_t sphere_count;
+    bool failed;
+} OocWriter;
+
+OocWriter* ooc_writer_create(const char* path, Aabb bounds, size_t memory_bytes) {
+
+    FILE* out = fopen(path, "wb+");
+    if (out == NULL) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return NULL;
+    }
+
+    vec3 extent = aabb_extent(bounds);
+    double largest = fmax(extent.x, fmax(extent.y, extent.z));
+
+    OocWriter* writer = malloc(sizeof(OocWriter));
+    *writer = (OocWriter) {
+        .path = path,
+        .out = out,
+        .page_size = ooc_page_size(),
+        .bounds = bounds,
+        .scale = vec3_div(vec3_all((1 << 21) - 1), vec3_max(extent, vec3_all(1e-9))),
+        .large_size = OOC_LARGE_FRACTION * largest,
+        .buffer_capacity = (memory_bytes / sizeof(OocRecord) > 1024) ? memory_bytes / sizeof(OocRecord) : 1024,
+        .runs = NULL,
+        .run_count = 0,
+        .large = NULL,
+        .large_count = 0,
+        .large_capacity = 0,
+        .sphere_count = 0,
+        .failed = false
+    };
+    writer->group_size = ooc_group_size(writer->page_size);
+    writer->page = malloc(writer->page_size);
+    writer->buffer = malloc(writer->buffer_capacity * sizeof(OocRecord));
+
+    return writer;
+}
+
+// Sorts the buffered records and moves them to a temporary file.
+void ooc_writer_spill(OocWriter* writer) {
+
+    qsort(writer->buffer, writer->buffer_count, sizeof(OocRecord), ooc_record_compare);
+
+    FILE* run = tmpfile();
+    if (run == NULL || fwrite(writer->buffer, sizeof(OocRecord), writer->buffer_count, run) != writer->buffer_count) {
+        fprintf(stderr, "Could not write a sort run for %s\n", writer->path);
+        writer->failed = true;
+        if (run != NULL) {
+            fclose(run);
+        }
+    } else {
+        rewind(run);
+        writer->runs = realloc(writer->runs, (writer->run_count + 1) * sizeof(FILE*));
+        writer->runs[writer->run_count++] = run;
+    }
+
+    writer->buffer_count = 0;
+}
+
+void ooc_writer_add(OocWriter* writer, OocSphere sphere) {
+
+    writer->sphere_count++;
+
+    if (2.0 * sphere.radius > writer->large_size) {
+        if (writer->large_count == writer->large_capacity) {
+            writer->large_capacity = (writer->large_capacity > 0) ? 2 * writer->large_capacity : 16;
+            writer->large = realloc(writer->large, writer->large_capacity * sizeof(OocSphere));
+        }
+        writer->large[writer->large_count++] = sphere;
+        return;
+    }
+
+    vec3 c = { sphere.center[0], sphere.center[1], sphere.center[2] };
+    vec3 q = vec3_mul(vec3_sub(c, writer->bounds.min), writer->scale);
+    uint64_t code = 0;
+    for (int a = 0; a < 3; a++) {
+        code |= ooc_spread_bits((uint64_t)clamp(vec3_axis(q, a), 0.0, (1 << 21) - 1)) << a;
+    }
+
+    writer->buffer[writer->buffer_count++] = (OocRecord) { .code = code, .sphere = sphere };
+    if (writer->buffer_count == writer->buffer_capacity) {
+        ooc_writer_spill(writer);
+    }
+}
+
+// Writes one cluster page and returns its bounds.
+Aabb ooc_writer_cluster(OocWriter* writer, const OocSphere* spheres, int count) {
+
+    memset(writer->page, 0, writer->page_size);
+
+    OocCluster* cluster = (OocCluster*)writer->page;
+    cluster->count = count;
+    Aabb bounds = aabb_empty;
+    int group_size = writer->group_size;
+
+    for (int g = 0; g * group_size < count; g++) {
+        Aabb group = aabb_empty;
+        for (int s = g * group_size; s < imin(count, (g + 1) * group_size); s++) {
+            cluster->spheres[s] = spheres[s];
+            group = aabb_union(group, ooc_sphere_bounds(&spheres[s]));
+        }
+        cluster->groups[g] = ooc_box(group);
+        bounds = aabb_union(bounds, group);
+    }
+
+    fwrite(writer->page, writer->page_size, 1, writer->out);
+    return bounds;
+}
+
+// Merges the sorted runs into clusters, writes the nodes and the large
+// spheres and closes the writer. Returns false and removes the file if
+// any step failed.
+bool ooc_writer_finish(OocWriter* writer) {
+
+    qsort(writer->buffer, writer->buffer_count, sizeof(OocRecord), ooc_record_compare);
+
+    // Sources of the merge are the runs and the sorted buffer, one head each.
+    int source_count = writer->run_count + 1;
+    OocRecord* heads = malloc(source_count * sizeof(OocRecord));
+    bool* live = malloc(source_count * sizeof(bool));
+    size_t buffer_next = 0;
+
+    for (int r = 0; r < writer->run_count; r++) {
+        live[r] = fread(&heads[r], sizeof(OocRecord), 1, writer->runs[r]) == 1;
+    }
+    live[writer->run_count] = buffer_next < writer->buffer_count;
+    if (live[writer->run_count]) {
+        heads[writer->run_count] = writer->buffer[buffer_next++];
+    }
+
+    // The header's page, rewritten once the counts are known.
+    memset(writer->page, 0, writer->page_size);
+    fwrite(writer->page, writer->page_size, 1, writer->out);
+
+    int capacity = OOC_CLUSTER_GROUPS * writer->group_size;
+    OocSphere* spheres = malloc(capacity * sizeof(OocSphere));
+    int filled = 0;
+    Aabb* cluster_bounds = NULL;
+    int32_t cluster_count = 0;
+    int32_t cluster_capacity = 0;
+
+    while (true) {
+
+        int best = -1;
+        for (int r = 0; r < source_count; r++) {
+            if (live[r] && (best < 0 || heads[r].code < heads[best].code)) {
+                best = r;
+            }
+        }
+
+        if (best >= 0) {
+            spheres[filled++] = heads[best].sphere;
+            if (best < writer->run_count) {
+                live[best] = fread(&heads[best], sizeof(OocRecord), 1, writer->runs[best]) == 1;
+            } else {
+                live[best] = buffer_next < writer->buffer_count;
+                if (live[best]) {
+                    heads[best] = writer->buffer[buffer_next++];
+                }
+            }
+        }
+
+        if (filled == capacity || (best < 0 && filled > 0)) {
+            if (cluster_count == cluster_capacity) {
+                cluster_capacity = (cluster_capacity > 0) ? 2 * cluster_capacity : 1024;
+                cluster_bounds = realloc(cluster_bounds, cluster_capacity * sizeof(Aabb));
+            }
+            cluster_bounds[cluster_count++] = ooc_writer_cluster(writer, spheres, filled);
+            filled = 0;
+        }
+
+        if (best < 0) {
+            break;
+        }
+    }
+
+    int32_t node_capacity = imax(2 * cluster_count - 1, 0);
+    OocNode* nodes = malloc(imax(node_capacity, 1) * sizeof(OocNode));
+    int64_t node_offset = (int64_t)(cluster_count + 1) * writer->page_size;
+    OocHeader header = {
+        .page_size = (int32_t)writer->page_size,
+        .sphere_count = writer->sphere_count,
+        .cluster_count = cluster_count,
+        .node_count = (cluster_count > 0) ? 1 : 0,
+        .node_offset = node_offset,
+        .large_count = writer->large_count,
+        .large_offset = node_offset + (int64_t)node_capacity * sizeof(OocNode)
+    };
+    memcpy(header.magic, OOC_MAGIC, sizeof(OOC_MAGIC));
+
+    if (cluster_count > 0) {
+        ooc_build_nodes(nodes, &header.node_count, cluster_bounds, 0, 0, cluster_count);
+    }
+    fwrite(nodes, sizeof(OocNode), header.node_count, writer->out);
+    fwrite(writer->large, sizeof(OocSphere), writer->large_count, writer->out);
+
+    rewind(writer->out);
+    fwrite(&header, sizeof(header), 1, writer->out);
+
+    bool ok = !writer->failed && !ferror(writer->out);
+    ok = (fclose(writer->out) == 0) && ok;
+    if (!ok) {
+        fprintf(stderr, "Could not write %s\n", writer->path);
+        remove(writer->path);
+    }
+
+    for (int r = 0; r < writer->run_count; r++) {
+        fclose(writer->runs[r]);
+    }
+    free(writer->runs);
+    free(writer->page);
+    free(writer->buffer);
+    free(writer->large);
+    free(spheres);
+    free(heads);
+    free(live);
+    free(nodes);
+    free(cluster_bounds);
+    free(writer);
+
+    return ok;
+}
+
+// Checks the node hierarchy before it is followed: children come after
+// their parent, so it has no cycles, and leaves name existing clusters.
+// Returns the traversal stack a ray needs, or 0 if the nodes are invalid.
+int ooc_check_nodes(const OocNode* nodes, int32_t node_count, int32_t cluster_count) {
+
+    int* depth = calloc(imax(node_count, 1), sizeof(int));
+    int max_depth = 0;
+    bool ok = true;
+
+    for (int32_t n = 0; n < node_count && ok; n++) {
+        const OocNode* node = &nodes[n];
+        if (node->child < 0) {
+            ok = node->cluster >= 0 && node->cluster < cluster_count;
+        } else {
+            ok = node->child > n && node->child < node_count - 1;
+            if (ok) {
+                depth[node->child] = imax(depth[node->child], depth[n] + 1);
+                depth[node->child + 1] = imax(depth[node->child + 1], depth[n] + 1);
+                max_depth = imax(max_depth, depth[n] + 1);
+            }
+        }
+    }
+
+    free(depth);
+
+    // A ray holds at most one far child per level besides the node it pops.
+    return ok ? max_depth + 2 : 0;
+}
+
+// Maps the clusters of a file written by OocWriter and reads its nodes and
+// large spheres. The palette must outlive the scene and may not be textured,
+// since clusters carry no texture coordinates. Spheres whose material is not
+// in the palette are skipped.
+OocScene* ooc_open(const char* path, const Material* materials, uint32_t material_count, size_t resident_bytes) {
+
+    OocHeader header;
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0 || pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) || fstat(fd, &st) != 0
+        || memcmp(header.magic, OOC_MAGIC, sizeof(OOC_MAGIC)) != 0) {
+        fprintf(stderr, "Could not open scene %s\n", path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+
+    // Every section must be where the writer puts it and inside the file.
+    int64_t page_size = header.page_size;
+    int64_t node_offset = (int64_t)(header.cluster_count + 1) * page_size;
+    int64_t large_offset = node_offset + (int64_t)header.node_count * (int64_t)sizeof(OocNode);
+    if (page_size < OOC_MIN_PAGE || page_size > OOC_MAX_PAGE || (page_size & (page_size - 1)) != 0
+        || header.cluster_count < 0 || header.node_count != imax(2 * header.cluster_count - 1, 0)
+        || header.node_offset != node_offset || header.large_offset != large_offset || st.st_size < large_offset
+        || header.large_count < 0 || header.large_count > (st.st_size - large_offset) / (int64_t)sizeof(OocSphere)) {
+        fprintf(stderr, "Corrupt or truncated scene %s\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    // Clusters are mapped and dropped a page at a time.
+    long system_page = sysconf(_SC_PAGESIZE);
+    if (page_size % system_page != 0) {
+        fprintf(stderr, "Scene %s was written for %lld byte pages, this system uses %ld byte pages\n",
+            path, (long long)page_size, system_page);
+        close(fd);
+        return NULL;
+    }
+
+    OocScene* scene = malloc(sizeof(OocScene));
+    *scene = (OocScene) {
+        .fd = fd,
+        .clusters = NULL,
+        .mapped_bytes = (size_t)header.cluster_count * page_size,
+        .page_size = page_size,
+        .group_size = ooc_group_size(page_size),
+        .fault_around = imax(1, (int)(OOC_FAULT_AROUND_BYTES / page_size)),
+        .cluster_count = header.cluster_count,
+        .sphere_count = header.sphere_count,
+        .nodes = malloc(imax(header.node_count, 1) * sizeof(OocNode)),
+        .node_count = header.node_count,
+        .large = malloc((header.large_count > 0 ? header.large_count : 1) * sizeof(OocSphere)),
+        .large_count = header.large_count,
+        .materials = materials,
+        .material_count = material_count,
+        .stamps = calloc(imax(header.cluster_count, 1), sizeof(atomic_int)),
+        .resident_limit = imax(1, (int)(resident_bytes / page_size)),
+        .evictions = 0,
+        .queued = 0,
+        .rounds = 0
+    };
+    atomic_store(&scene->resident_count, 0);
+    atomic_store(&scene->loads, 0);
+
+    ssize_t node_bytes = header.node_count * (ssize_t)sizeof(OocNode);
+    ssize_t large_bytes = header.large_count * (ssize_t)sizeof(OocSphere);
+    bool ok = pread(fd, scene->nodes, node_bytes, node_offset) == node_bytes
+        && pread(fd, scene->large, large_bytes, large_offset) == large_bytes;
+
+    scene->stack_size = ok ? ooc_check_nodes(scene->nodes, scene->node_count, scene->cluster_count) : 0;
+    ok = ok && scene->stack_size > 0;
+
+    if (!ok) {
+        fprintf(stderr, "Corrupt or truncated scene %s\n", path);
+    } else if (scene->mapped_bytes > 0) {
+        void* clusters = mmap(NULL, scene->mapped_bytes, PROT_READ, MAP_SHARED, fd, page_size);
+        ok = clusters != MAP_FAILED;
+        if (ok) {
+            // Faults should only bring in the cluster being visited.
+            madvise(clusters, scene->mapped_bytes, MADV_RANDOM);
+            scene->clusters = clusters;
+        } else {
+            fprintf(stderr, "Could not map scene %s: %s\n", path, strerror(errno));
+        }
+    }
+
+    if (!ok) {
+        close(fd);
+        free(scene->nodes);
+        free(scene->large);
+        free(scene->stamps);
+        free(scene);
+        return NULL;
+    }
+
+    return scene;
+}
+
+void ooc_close(OocScene* scene) {
+    if (scene->clusters != NULL) {
+        munmap((void*)scene->clusters, scene->mapped_bytes);
+    }
+    close(scene->fd);
+    free(scene->nodes);
+    free(scene->large);
+    free(scene->stamps);
+    free(scene);
+}
+
+const OocCluster* ooc_cluster(const OocScene* scene, int32_t cluster) {
+    return (const OocCluster*)(scene->clusters + (size_t)cluster * scene->page_size);
+}
+
+// Traversal state of one path, kept between rounds while it waits for a cluster.
+typedef struct OocRay {
+    Ray ray;
+    vec3 throughput;
+    uint64_t rng;
+    int32_t pixel;
+    int32_t bounce;
+    bool alive;
+    double t;             // Closest hit so far
+    vec3 normal;
+    bool front_face;
+    uint32_t material;    // OOC_NO_MATERIAL while nothing was hit
+    int32_t cluster;      // Next cluster to visit, -1 once the closest hit is final
+    int32_t top;          // Entries on the ray's node stack
+} OocRay;
+
+FORCE_INLINE void ooc_hit_sphere(const OocScene* scene, const OocSphere* p, OocRay* r) {
+
+    if (p->material >= scene->material_count) {
+        return;
+    }
+
+    Hit hit;
+    Sphere sphere = { .center = { p->center[0], p->center[1], p->center[2] }, .radius = p->radius, .velocity = vec3_all(0.0) };
+    if (sphere_hit_kernel(&sphere, r->ray, interval(0.001, r->t), &hit)) {
+        r->t = hit.t;
+        r->normal = hit.normal;
+        r->front_face = hit.front_face;
+        r->material = p->material;
+    }
+}
+
+// Pops nodes front to back until the next leaf the ray enters before its
+// closest hit, which becomes r->cluster. The stack stays with the ray, so
+// it resumes here after visiting that cluster instead of at the root.
+void ooc_ray_advance(const OocScene* scene, OocRay* r, int32_t* stack) {
+
+    vec3 inv = vec3_div(vec3_all(1.0), r->ray.direction);
+
+    while (r->top > 0) {
+
+        const OocNode* node = &scene->nodes[stack[--r->top]];
+        if (!ooc_box_hit(&node->bounds, r->ray.origin, inv, 0.001, r->t)) {
+            continue;
+        }
+
+        if (node->child < 0) {
+            r->cluster = node->cluster;
+            return;
+        }
+
+        const OocBox* a = &scene->nodes[node->child].bounds;
+        const OocBox* b = &scene->nodes[node->child + 1].bounds;
+        double toward = 0.0;
+        for (int axis = 0; axis < 3; axis++) {
+            toward += (b->min[axis] + b->max[axis] - a->min[axis] - a->max[axis]) * vec3_axis(r->ray.direction, axis);
+        }
+        // Near child on top, its hits cull the far one.
+        stack[r->top++] = (toward > 0.0) ? node->child + 1 : node->child;
+        stack[r->top++] = (toward > 0.0) ? node->child : node->child + 1;
+    }
+
+    r->cluster = -1;
+}
+
+// Tests the resident large spheres, then starts the traversal at the root.
+void ooc_ray_start(const OocScene* scene, OocRay* r, int32_t* stack) {
+
+    r->t = INFINITY;
+    r->material = OOC_NO_MATERIAL;
+    for (int64_t s = 0; s < scene->large_count; s++) {
+        ooc_hit_sphere(scene, &scene->large[s], r);
+    }
+
+    r->top = 0;
+    if (scene->node_count > 0) {
+        stack[r->top++] = 0;
+    }
+    ooc_ray_advance(scene, r, stack);
+}
+
+// Tests the ray against the spheres of the cluster whose group box it
+// enters and moves it on to its next cluster.
+void ooc_visit(OocScene* scene, int32_t cluster, OocRay* r, int32_t* stack, int stamp) {
+
+    if (atomic_load_explicit(&scene->stamps[cluster], memory_order_relaxed) != stamp
+        && atomic_exchange_explicit(&scene->stamps[cluster], stamp, memory_order_relaxed) == 0) {
+        atomic_fetch_add(&scene->loads, 1);
+        atomic_fetch_add(&scene->resident_count, 1);
+    }
+
+    const OocCluster* data = ooc_cluster(scene, cluster);
+    int group_size = scene->group_size;
+    int count = imin(imax(data->count, 0), OOC_CLUSTER_GROUPS * group_size);
+    vec3 inv = vec3_div(vec3_all(1.0), r->ray.direction);
+
+    for (int g = 0; g * group_size < count; g++) {
+        if (!ooc_box_hit(&data->groups[g], r->ray.origin, inv, 0.001, r->t)) {
+            continue;
+        }
+        for (int s = g * group_size; s < imin(count, (g + 1) * group_size); s++) {
+            ooc_hit_sphere(scene, &data->spheres[s], r);
+        }
+    }
+
+    ooc_ray_advance(scene, r, stack);
+}
+
+typedef struct OocContext {
+    const Camera* cam;
+    OocScene* scene;
+    vec3* pixels;
+    OocRay* rays;
+    int32_t* stacks;           // scene->stack_size node indices per ray
+    int ray_count;
+    int64_t batch_start;
+    int32_t* round_clusters;   // Clusters with queued rays, in file order
+    int* round_start;          // Offsets into round_rays per round cluster
+    int* round_rays;
+    int round_count;
+    long round_loads;          // Round clusters that are not resident yet
+    int stamp;
+    atomic_int next;
+    atomic_int alive;
+} OocContext;
+
+void* ooc_generate_worker(void* arg) {
+
+    OocContext* ctx = arg;
+    const Camera* cam = ctx->cam;
+    int pixel_count = cam->image_width * cam->image_height;
+
+    for (int k = atomic_fetch_add(&ctx->next, 1); k < ctx->ray_count; k = atomic_fetch_add(&ctx->next, 1)) {
+
+        int64_t index = ctx->batch_start + k;
+        OocRay* r = &ctx->rays[k];
+        r->pixel = (int32_t)(index % pixel_count);
+
+        // Seeded per path, so the image does not depend on the thread count.
+        frand_seed(camera_seed(cam, index, ~0u));
+        r->ray = get_ray(cam, r->pixel % cam->image_width, r->pixel / cam->image_width);
+        r->rng = frand_state;
+
+        r->throughput = vec3_all(1.0);
+        r->bounce = 0;
+        r->alive = true;
+        ooc_ray_start(ctx->scene, r, &ctx->stacks[(size_t)k * ctx->scene->stack_size]);
+    }
+
+    return NULL;
+}
+
+// Processes one round cluster at a time. Rays keep going while their next
+// cluster is resident and wait for the next round at the first one that is not.
+void* ooc_trace_worker(void* arg) {
+
+    OocContext* ctx = arg;
+
+    for (int k = atomic_fetch_add(&ctx->next, 1); k < ctx->round_count; k = atomic_fetch_add(&ctx->next, 1)) {
+        for (int q = ctx->round_start[k]; q < ctx->round_start[k + 1]; q++) {
+            OocRay* r = &ctx->rays[ctx->round_rays[q]];
+            int32_t* stack = &ctx->stacks[(size_t)ctx->round_rays[q] * ctx->scene->stack_size];
+            int32_t cluster = ctx->round_clusters[k];
+            do {
+                ooc_visit(ctx->scene, cluster, r, stack, ctx->stamp);
+                cluster = r->cluster;
+            } while (cluster >= 0 && atomic_load_explicit(&ctx->scene->stamps[cluster], memory_order_relaxed) != 0);
+        }
+    }
+
+    return NULL;
+}
+
+// Shades the closest hits and starts the scattered rays.
+void* ooc_shade_worker(void* arg) {
+
+    OocContext* ctx = arg;
+    const Camera* cam = ctx->cam;
+    int alive = 0;
+
+    for (int k = atomic_fetch_add(&ctx->next, 1); k < ctx->ray_count; k = atomic_fetch_add(&ctx->next, 1)) {
+
+        OocRay* r = &ctx->rays[k];
+        if (!r->alive) {
+            continue;
+        }
+
+        if (r->material == OOC_NO_MATERIAL) {
+            vec3 unit_direction = vec3_norm(r->ray.direction);
+            double a = 0.5 * (unit_direction.y + 1.0);
+            static const vec3 background = { 0.5, 0.7, 1.0 };
+            vec3 sky = vec3_add(vec3_all(1.0 - a), vec3_scale(background, a));
+            ctx->pixels[r->pixel] = vec3_add(ctx->pixels[r->pixel], vec3_mul(r->throughput, sky));
+            r->alive = false;
+            continue;
+        }
+
+        Hit hit = {
+            .p = ray_at(r->ray, r->t),
+            .normal = r->normal,
+            .mat = &ctx->scene->materials[r->material],
+            .hittable = NULL,
+            .t = r->t,
+            .front_face = r->front_face
+        };
+
+        frand_state = r->rng;
+        vec3 attenuation;
+        vec3 scattered;
+        bool scatters = material_scatter(*hit.mat, r->ray.direction, &hit, &attenuation, &scattered);
+        r->rng = frand_state;
+
+        if (!scatters || ++r->bounce >= cam->max_depth) {
+            r->alive = false;
+            continue;
+        }
+
+        r->throughput = vec3_mul(r->throughput, attenuation);
+        r->ray.origin = hit.p;
+        r->ray.direction = scattered;
+        ooc_ray_start(ctx->scene, r, &ctx->stacks[(size_t)k * ctx->scene->stack_size]);
+        alive++;
+    }
+
+    atomic_fetch_add(&ctx->alive, alive);
+
+    return NULL;
+}
+
+// Buckets the waiting rays by their next cluster, returns false if none is waiting.
+bool ooc_build_round(OocContext* ctx, int32_t* counts) {
+
+    OocScene* scene = ctx->scene;
+    memset(counts, 0, scene->cluster_count * sizeof(int32_t));
+
+    int waiting = 0;
+    for (int k = 0; k < ctx->ray_count; k++) {
+        if (ctx->rays[k].alive && ctx->rays[k].cluster >= 0) {
+            counts[ctx->rays[k].cluster]++;
+            waiting++;
+        }
+    }
+    if (waiting == 0) {
+        return false;
+    }
+
+    // Clusters that are resident already are always part of the round,
+    // loading the others is limited to what fits next to them.
+    long resident = 0;
+    for (int32_t c = 0; c < scene->cluster_count; c++) {
+        if (counts[c] > 0 && atomic_load_explicit(&scene->stamps[c], memory_order_relaxed) != 0) {
+            resident++;
+        }
+    }
+
+    scene->rounds++;
+    ctx->stamp = scene->rounds;
+    ctx->round_count = 0;
+    ctx->round_loads = 0;
+    int offset = 0;
+
+    for (int32_t c = 0; c < scene->cluster_count; c++) {
+        if (counts[c] == 0) {
+            continue;
+        }
+        if (atomic_load_explicit(&scene->stamps[c], memory_order_relaxed) != 0) {
+            atomic_store_explicit(&scene->stamps[c], ctx->stamp, memory_order_relaxed);
+        } else if (ctx->round_loads < scene->resident_limit - resident) {
+            ctx->round_loads++;
+        } else {
+            counts[c] = -1;   // Waits for a later round
+            continue;
+        }
+        ctx->round_clusters[ctx->round_count] = c;
+        ctx->round_start[ctx->round_count++] = offset;
+        offset += counts[c];
+        counts[c] = offset - counts[c];
+    }
+    ctx->round_start[ctx->round_count] = offset;
+
+    for (int k = 0; k < ctx->ray_count; k++) {
+        if (ctx->rays[k].alive && ctx->rays[k].cluster >= 0 && counts[ctx->rays[k].cluster] >= 0) {
+            ctx->round_rays[counts[ctx->rays[k].cluster]++] = k;
+        }
+    }
+
+    // Start reading every cluster of the round before the first one is needed.
+    for (int k = 0; k < ctx->round_count; k++) {
+        int32_t c = ctx->round_clusters[k];
+        if (atomic_load_explicit(&scene->stamps[c], memory_order_relaxed) == 0) {
+            madvise((void*)ooc_cluster(scene, c), scene->page_size, MADV_WILLNEED);
+        }
+    }
+
+    scene->queued += waiting;
+    return true;
+}
+
+typedef struct OocStamp {
+    int stamp;
+    int32_t cluster;
+} OocStamp;
+
+int ooc_stamp_compare(const void* a, const void* b) {
+    return ((const OocStamp*)a)->stamp - ((const OocStamp*)b)->stamp;
+}
+
+// Drops the least recently visited clusters until keep are left.
+void ooc_evict(OocScene* scene, long keep) {
+
+    long resident = atomic_load(&scene->resident_count);
+    if (resident <= keep) {
+        return;
+    }
+
+    OocStamp* stamps = malloc(resident * sizeof(OocStamp));
+    long count = 0;
+    for (int32_t c = 0; c < scene->cluster_count && count < resident; c++) {
+        int stamp = atomic_load_explicit(&scene->stamps[c], memory_order_relaxed);
+        if (stamp != 0) {
+            stamps[count++] = (OocStamp) { .stamp = stamp, .cluster = c };
+        }
+    }
+    qsort(stamps, count, sizeof(OocStamp), ooc_stamp_compare);
+
+    for (long k = 0; k < count - keep; k++) {
+        int32_t c = stamps[k].cluster;
+        madvise((void*)ooc_cluster(scene, c), scene->page_size, MADV_DONTNEED);
+        atomic_store_explicit(&scene->stamps[c], 0, memory_order_relaxed);
+        scene->evictions++;
+    }
+    atomic_store(&scene->resident_count, (count < keep) ? count : keep);
+
+    free(stamps);
+}
+
+// A fault maps the neighbouring cached pages as well, which would keep
+// clusters in memory without being counted. Unmaps every page that is not
+// resident around the clusters (in file order) faulted in this round.
+void ooc_trim(OocScene* scene, const int32_t* clusters, int count) {
+
+    int32_t done = 0;
+
+    for (int k = 0; k < count; k++) {
+
+        int32_t c = imax(clusters[k] - (scene->fault_around - 1), done);
+        int32_t end = imin(clusters[k] + scene->fault_around, scene->cluster_count);
+
+        while (c < end) {
+            if (atomic_load_explicit(&scene->stamps[c], memory_order_relaxed) != 0) {
+                c++;
+                continue;
+            }
+            int32_t run = c;
+            while (c < end && atomic_load_explicit(&scene->stamps[c], memory_order_relaxed) == 0) {
+                c++;
+            }
+            madvise((void*)ooc_cluster(scene, run), (size_t)(c - run) * scene->page_size, MADV_DONTNEED);
+        }
+        done = end;
+    }
+}
+
+typedef struct OocMemory {
+    double rss_mb;
+    double peak_rss_mb;
+    long minor_faults;
+    long major_faults;
+} OocMemory;
+
+OocMemory ooc_memory(void) {
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    OocMemory memory = {
+        .rss_mb = 0.0,
+        .peak_rss_mb = usage.ru_maxrss / 1024.0,
+        .minor_faults = usage.ru_minflt,
+        .major_faults = usage.ru_majflt
+    };
+
+    // Linux only, the second field counts resident pages.
+    FILE* statm = fopen("/proc/self/statm", "r");
+    long size, resident;
+    if (statm != NULL) {
+        if (fscanf(statm, "%ld %ld", &size, &resident) == 2) {
+            memory.rss_mb = resident * (double)sysconf(_SC_PAGESIZE) / (1 << 20);
+        }
+        fclose(statm);
+    }
+
+    return memory;
+}
+
+// Traces every sample as a wavefront of batches. Each bounce of a batch
+// runs rounds in which the waiting rays are bucketed by their next cluster,
+// so a cluster is paged in once per round however many rays visit it.
+void ooc_render_pixels(const Camera* cam, OocScene* scene, vec3* pixels) {
+
+    int thread_count = parallel_thread_count(cam->thread_count);
+    int pixel_count = cam->image_width * cam->image_height;
+    int64_t total = (int64_t)pixel_count * cam->samples_per_pixel;
+    int batch = imin(OOC_BATCH_RAYS, pixel_count);
+
+    OocContext ctx = {
+        .cam = cam,
+        .scene = scene,
+        .pixels = pixels,
+        .rays = malloc(batch * sizeof(OocRay)),
+        .stacks = malloc((size_t)batch * scene->stack_size * sizeof(int32_t)),
+        .round_clusters = malloc(imax(imin(batch, scene->cluster_count), 1) * sizeof(int32_t)),
+        .round_start = malloc((imin(batch, scene->cluster_count) + 1) * sizeof(int)),
+        .round_rays = malloc(batch * sizeof(int))
+    };
+    int32_t* counts = malloc(imax(scene->cluster_count, 1) * sizeof(int32_t));
+
+    memset(pixels, 0, pixel_count * sizeof(vec3));
+
+    OocMemory before = ooc_memory();
+    double start = clock_ns();
+
+    for (int64_t first = 0; first < total; first += batch) {
+
+        ctx.batch_start = first;
+        ctx.ray_count = (int)((total - first < batch) ? total - first : batch);
+        atomic_store(&ctx.next, 0);
+        parallel_run(thread_count, ooc_generate_worker, &ctx);
+
+        while (true) {
+
+            while (ooc_build_round(&ctx, counts)) {
+                // Makes room for the round's loads, its resident clusters are the most recent.
+                ooc_evict(scene, scene->resident_limit - ctx.round_loads);
+                atomic_store(&ctx.next, 0);
+                parallel_run(thread_count, ooc_trace_worker, &ctx);
+                ooc_trim(scene, ctx.round_clusters, ctx.round_count);
+            }
+
+            atomic_store(&ctx.next, 0);
+            atomic_store(&ctx.alive, 0);
+            parallel_run(thread_count, ooc_shade_worker, &ctx);
+            if (atomic_load(&ctx.alive) == 0) {
+                break;
+            }
+        }
+    }
+
+    OocMemory after = ooc_memory();
+
+    fprintf(stderr, "Rendered in %.1f ms\n", (clock_ns() - start) * 1e-6);
+    fprintf(stderr, "Out of core: %lld spheres, %lld large, %d clusters (%.1f MB mapped), %d rounds, %lld queued rays, %lld cluster loads, %lld evictions\n",
+        (long long)scene->sphere_count, (long long)scene->large_count, scene->cluster_count, scene->mapped_bytes / (double)(1 << 20),
+        scene->rounds, scene->queued, (long long)atomic_load(&scene->loads), scene->evictions);
+    fprintf(stderr, "Memory: %.1f MB resident (%.1f MB before, peak %.1f MB), %ld minor and %ld major page faults\n",
+        after.rss_mb, before.rss_mb, after.peak_rss_mb,
+        after.minor_faults - before.minor_faults, after.major_faults - before.major_faults);
+
+    free(counts);
+    free(ctx.rays);
+    free(ctx.stacks);
+    free(ctx.round_clusters);
+    free(ctx.round_start);
+    free(ctx.round_rays);
+}
+
+void ooc_render_file(Camera* cam, OocScene* scene, FILE* out) {
+
+    camera_init(cam);
+
+    int pixel_count = cam->image_width * cam->image_height;
+    vec3* pixels = malloc(pixel_count * sizeof(vec3));
+
+    ooc_render_pixels(cam, scene, pixels);
+    camera_write_ppm(cam, pixels, out);
+
+    free(pixels);
+
+    fprintf(stderr, "Done\n");
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "util.h"
+
+int parallel_thread_count(int requested) {
+    return (requested > 0) ? requested : imax(1, sysconf(_SC_NPROCESSORS_ONLN));
+}
+
+// Runs worker(arg) on thread_count threads and waits for all of them.
+// Workers pull their work from a shared counter, so if a thread cannot be
+// created the calling thread runs the worker too and takes over its share.
+void parallel_run(int thread_count, void* (*worker)(void*), void* arg) {
+
+    pthread_t* threads = malloc(thread_count * sizeof(pthread_t));
+    int created = 0;
+
+    while (created < thread_count && pthread_create(&threads[created], NULL, worker, arg) == 0) {
+        created++;
+    }
+    if (created < thread_count) {
+        worker(arg);
+    }
+    for (int t = 0; t < created; t++) {
+        pthread_join(threads[t], NULL);
+    }
+
+    free(threads);
+}
\ No newline at end of file
@@ -0,0 +1,245 @@
+#pragma once
+
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#include "util.h"
+#include "vec3.h"
+#include "ray.h"
+#include "aabb.h"
+#include "hit.h"
+#include "hittable.h"
+#include "scene.h"
+#include "parallel.h"
+#include "camera.h"
+
+#define RASTER_TILE 16
+
+// Pixel rectangle, inclusive, that can contain samples whose ray hits the sphere.
+typedef struct RasterRect {
+    int x0, y0, x1, y1;
+    int object;
+} RasterRect;
+
+// Screen-space bins of the spheres primary rays can hit, valid for pinhole
+// cameras only since every primary ray must start at the camera center.
+typedef struct PrimaryRaster {
+    int tiles_x, tiles_y;
+    int* bin_start;        // Offsets into bin_items, one past the last tile included
+    RasterRect* bin_items;
+    int* global;           // Spheres without a finite projection, tested by every primary ray
+    int global_count;
+    int* gbuffer;          // Sphere hit by the ray through each pixel's center, -1 where it escaped
+    int width;
+} PrimaryRaster;
+
+// Projects p to fractional pixel coordinates, returns false if p is not in front of the camera.
+bool raster_project(const Camera* cam, vec3 p, double* x, double* y) {
+
+    vec3 q = vec3_sub(p, cam->center);
+    double z = -vec3_dot(q, cam->w);
+    if (z <= 1e-9 * cam->focus_dist) {
+        return false;
+    }
+
+    vec3 on_plane = vec3_sub(vec3_scale(q, cam->focus_dist / z), vec3_sub(cam->pixel00_loc, cam->center));
+    *x = vec3_dot(on_plane, cam->pixel_delta_u) / vec3_sqrlen(cam->pixel_delta_u);
+    *y = vec3_dot(on_plane, cam->pixel_delta_v) / vec3_sqrlen(cam->pixel_delta_v);
+
+    return true;
+}
+
+// Bounds the projection of the sphere by the projections of the corners of
+// the box it sweeps while the shutter is open, padded by a pixel for the
+// sample jitter. Returns false if the sphere reaches behind the camera.
+bool raster_sphere_rect(const Camera* cam, const Sphere* sphere, RasterRect* rect) {
+
+    Aabb box = sphere_bounds(sphere, interval(cam->time, cam->time + cam->shutter));
+
+    double min_x = INFINITY, min_y = INFINITY;
+    double max_x = -INFINITY, max_y = -INFINITY;
+
+    for (int c = 0; c < 8; c++) {
+        vec3 corner = {
+            (c & 1) ? box.max.x : box.min.x,
+            (c & 2) ? box.max.y : box.min.y,
+            (c & 4) ? box.max.z : box.min.z
+        };
+        double x, y;
+        if (!raster_project(cam, corner, &x, &y)) {
+            return false;
+        }
+        min_x = fmin(min_x, x);
+        min_y = fmin(min_y, y);
+        max_x = fmax(max_x, x);
+        max_y = fmax(max_y, y);
+    }
+
+    // Far outside the image, saturate rather than overflow.
+    double limit = 4.0 * (cam->image_width + cam->image_height);
+    rect->x0 = (int)floor(clamp(min_x, -limit, limit)) - 1;
+    rect->y0 = (int)floor(clamp(min_y, -limit, limit)) - 1;
+    rect->x1 = (int)ceil(clamp(max_x, -limit, limit)) + 1;
+    rect->y1 = (int)ceil(clamp(max_y, -limit, limit)) + 1;
+
+    return true;
+}
+
+// Tests only the spheres whose bounds cover pixel (i, j), the seed first.
+// The index of the hit sphere is stored in object unless it is NULL.
+FORCE_INLINE bool raster_hit_kernel(const PrimaryRaster* raster, Scene scene, Ray ray, Interval ray_t, int i, int j, int seed, Hit* hit, int* object) {
+
+    Hit temp;
+    bool hit_anything = false;
+    double closest_so_far = ray_t.max;
+    int closest_object = -1;
+
+    // The pixel center's hit usually is the sample's too, testing it first shortens the ray.
+    if (seed >= 0 && hittable_hit_indexed(scene.hittables, scene.spheres, seed, ray, ray_t, &temp, true)) {
+        hit_anything = true;
+        closest_so_far = temp.t;
+        closest_object = seed;
+        *hit = temp;
+    }
+
+    for (int k = 0; k < raster->global_count; k++) {
+        if (hittable_hit_indexed(scene.hittables, scene.spheres, raster->global[k], ray, interval(ray_t.min, closest_so_far), &temp, true)) {
+            hit_anything = true;
+            closest_so_far = temp.t;
+            closest_object = raster->global[k];
+            *hit = temp;
+        }
+    }
+
+    int tile = (j / RASTER_TILE) * raster->tiles_x + i / RASTER_TILE;
+    for (int k = raster->bin_start[tile]; k < raster->bin_start[tile + 1]; k++) {
+        const RasterRect* rect = &raster->bin_items[k];
+        if (i < rect->x0 || i > rect->x1 || j < rect->y0 || j > rect->y1 || rect->object == seed) {
+            continue;
+        }
+        if (hittable_hit_indexed(scene.hittables, scene.spheres, rect->object, ray, interval(ray_t.min, closest_so_far), &temp, true)) {
+            hit_anything = true;
+            closest_so_far = temp.t;
+            closest_object = rect->object;
+            *hit = temp;
+        }
+    }
+
+    if (object != NULL) {
+        *object = closest_object;
+    }
+
+    return hit_anything;
+}
+
+typedef struct RasterContext {
+    const Camera* cam;
+    Scene scene;
+    PrimaryRaster* raster;
+    atomic_int next_row;
+} RasterContext;
+
+void* raster_gbuffer_worker(void* arg) {
+
+    RasterContext* ctx = arg;
+    const Camera* cam = ctx->cam;
+
+    for (int j = atomic_fetch_add(&ctx->next_row, 1); j < cam->image_height; j = atomic_fetch_add(&ctx->next_row, 1)) {
+        for (int i = 0; i < cam->image_width; i++) {
+
+            vec3 pixel_center = vec3_add(cam->pixel00_loc, vec3_add(vec3_scale(cam->pixel_delta_u, i), vec3_scale(cam->pixel_delta_v, j)));
+            Ray ray = { .origin = cam->center, .direction = vec3_sub(pixel_center, cam->center), .time = cam->time };
+
+            // Samples are jittered across the pixel, so only the object
+            // is kept, as the seed tested first by each sample's ray.
+            Hit hit;
+            raster_hit_kernel(ctx->raster, ctx->scene, ray, interval(0.001, INFINITY), i, j, -1, &hit,
+                &ctx->raster->gbuffer[j * cam->image_width + i]);
+        }
+    }
+
+    return NULL;
+}
+
+// Bins the projected bounds of every sphere into screen tiles in two linear
+// passes, then resolves the G-buffer of pixel center hits from the bins.
+// Requires a pinhole camera, an initialized camera and scene.spheres.
+PrimaryRaster raster_build(const Camera* cam, Scene scene, int thread_count) {
+
+    PrimaryRaster raster = {
+        .tiles_x = (cam->image_width + RASTER_TILE - 1) / RASTER_TILE,
+        .tiles_y = (cam->image_height + RASTER_TILE - 1) / RASTER_TILE,
+        .global = malloc(imax(scene.size, 1) * sizeof(int)),
+        .global_count = 0,
+        .gbuffer = malloc(cam->image_width * cam->image_height * sizeof(int)),
+        .width = cam->image_width
+    };
+
+    int tile_count = raster.tiles_x * raster.tiles_y;
+    RasterRect* rects = malloc(imax(scene.size, 1) * sizeof(RasterRect));
+    bool* visible = malloc(imax(scene.size, 1) * sizeof(bool));
+
+    raster.bin_start = calloc(tile_count + 1, sizeof(int));
+
+    for (int s = 0; s < scene.size; s++) {
+
+        visible[s] = false;
+        if (!raster_sphere_rect(cam, &scene.spheres[s], &rects[s])) {
+            raster.global[raster.global_count++] = s;
+            continue;
+        }
+
+        rects[s].object = s;
+        rects[s].x0 = imax(rects[s].x0, 0);
+        rects[s].y0 = imax(rects[s].y0, 0);
+        rects[s].x1 = imin(rects[s].x1, cam->image_width - 1);
+        rects[s].y1 = imin(rects[s].y1, cam->image_height - 1);
+        visible[s] = rects[s].x0 <= rects[s].x1 && rects[s].y0 <= rects[s].y1;
+
+        if (visible[s]) {
+            for (int ty = rects[s].y0 / RASTER_TILE; ty <= rects[s].y1 / RASTER_TILE; ty++) {
+                for (int tx = rects[s].x0 / RASTER_TILE; tx <= rects[s].x1 / RASTER_TILE; tx++) {
+                    raster.bin_start[ty * raster.tiles_x + tx + 1]++;
+                }
+            }
+        }
+    }
+
+    for (int t = 0; t < tile_count; t++) {
+        raster.bin_start[t + 1] += raster.bin_start[t];
+    }
+
+    raster.bin_items = malloc(imax(raster.bin_start[tile_count], 1) * sizeof(RasterRect));
+    int* fill = malloc(tile_count * sizeof(int));
+    for (int t = 0; t < tile_count; t++) {
+        fill[t] = raster.bin_start[t];
+    }
+
+    for (int s = 0; s < scene.size; s++) {
+        if (!visible[s]) {
+            continue;
+        }
+        for (int ty = rects[s].y0 / RASTER_TILE; ty <= rects[s].y1 / RASTER_TILE; ty++) {
+            for (int tx = rects[s].x0 / RASTER_TILE; tx <= rects[s].x1 / RASTER_TILE; tx++) {
+                raster.bin_items[fill[ty * raster.tiles_x + tx]++] = rects[s];
+            }
+        }
+    }
+
+    free(fill);
+    free(visible);
+    free(rects);
+
+    RasterContext ctx = { .cam = cam, .scene = scene, .raster = &raster };
+    atomic_store(&ctx.next_row, 0);
+    parallel_run(thread_count, raster_gbuffer_worker, &ctx);
+
+    return raster;
+}
+
+void raster_destroy(PrimaryRaster raster) {
+    free(raster.bin_start);
+    free(raster.bin_items);
+    free(raster.global);
+    free(raster.gbuffer);
+}
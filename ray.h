@@ -5,15 +5,57 @@
 typedef struct Ray {
     vec3 origin;
     vec3 direction;
+    double time;
 } Ray;
 
 Ray ray_between(vec3 a, vec3 b) {
     return (Ray) {
         .origin = a,
-        .direction = vec3_sub(b, a)
+        .direction = vec3_sub(b, a),
+        .time = 0.0
     };
 }
 
 vec3 ray_at(Ray r, double t) {
     return vec3_add(r.origin, vec3_scale(r.direction, t));
+}
+
+// Angular footprint given to rays leaving a diffuse surface, whose texture
+// lookups are averaged over the whole lobe anyway.
+#define RAY_DIFFUSE_SPREAD 0.25
+
+// Changes of a ray's origin and unit direction from one pixel to the next,
+// which give the footprint of a pixel on the surfaces the ray hits.
+typedef struct RayDifferential {
+    vec3 origin_dx, origin_dy;
+    vec3 direction_dx, direction_dy;
+} RayDifferential;
+
+// Moves the origin differentials to the hit at t on the plane with normal n.
+void ray_differential_transfer(RayDifferential* rd, Ray ray, double t, vec3 n) {
+
+    double len = vec3_len(ray.direction);
+    vec3 d = vec3_scale(ray.direction, 1.0 / len);
+    double s = t * len;
+    double dn = vec3_dot(d, n);
+    dn = (fabs(dn) < 1e-6) ? copysign(1e-6, dn) : dn;
+
+    vec3 px = vec3_add(rd->origin_dx, vec3_scale(rd->direction_dx, s));
+    vec3 py = vec3_add(rd->origin_dy, vec3_scale(rd->direction_dy, s));
+    rd->origin_dx = vec3_sub(px, vec3_scale(d, vec3_dot(px, n) / dn));
+    rd->origin_dy = vec3_sub(py, vec3_scale(d, vec3_dot(py, n) / dn));
+}
+
+// Mirrors the direction differentials, ignoring the surface's curvature.
+void ray_differential_reflect(RayDifferential* rd, vec3 n) {
+    rd->direction_dx = vec3_sub(rd->direction_dx, vec3_scale(n, 2.0 * vec3_dot(rd->direction_dx, n)));
+    rd->direction_dy = vec3_sub(rd->direction_dy, vec3_scale(n, 2.0 * vec3_dot(rd->direction_dy, n)));
+}
+
+// Sets the direction differentials to a cone of the given angle around direction.
+void ray_differential_spread(RayDifferential* rd, vec3 direction, double spread) {
+    vec3 d = vec3_norm(direction);
+    vec3 t = vec3_norm(vec3_cross(fabs(d.x) > 0.5 ? (vec3) { 0.0, 1.0, 0.0 } : (vec3) { 1.0, 0.0, 0.0 }, d));
+    rd->direction_dx = vec3_scale(t, spread);
+    rd->direction_dy = vec3_scale(vec3_cross(d, t), spread);
 }
\ No newline at end of file
@@ -0,0 +1,326 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "util.h"
+#include "vec3.h"
+#include "scene.h"
+#include "tiles.h"
+#include "parallel.h"
+#include "denoise.h"
+#include "irradiance.h"
+#include "texture.h"
+#include "raster.h"
+#include "camera.h"
+#include "kernel.h"
+
+// Pixel stride of the pilot pass inside each block, 4 traces 1/16 of the pixels once.
+#define PILOT_STRIDE 4
+
+typedef struct RenderContext {
+    const Camera* cam;
+    const RenderKernel* kernel;
+    FrameData frame;
+    Scene scene;
+    vec3* pixels;
+    Aov* aovs;         // NULL unless denoising or writing AOVs
+    CostMap costs;
+    const TileSchedule* schedule;
+    pthread_mutex_t* tile_locks;
+    atomic_int next;
+} RenderContext;
+
+// A frame from its setup to its accumulated sums, split into stages so that
+// a sequence can overlap the stages of consecutive frames.
+typedef struct RenderFrame {
+    Camera cam;
+    Scene scene;       // Caller's scene, ctx.scene is retimed to the shutter
+    RenderContext ctx;
+    PrimaryRaster raster;
+    TileSchedule schedule;
+    bool pinned;       // Every scheduling parameter is fixed, so there is no pilot pass
+    int block_count;
+} RenderFrame;
+
+// Selects the kernel and builds the frame's grid, raster and irradiance
+// cache for an initialized camera. The pilot pass comes next, one block at
+// a time, unless the schedule is pinned.
+void render_frame_begin(RenderFrame* f, const Camera* cam, Scene scene, vec3* pixels, Aov* aovs, int thread_count) {
+
+    *f = (RenderFrame) {
+        .cam = *cam,
+        .scene = scene,
+        .pinned = cam->tile_size > 0 && cam->samples_per_task > 0
+            && cam->tile_order != TILE_ORDER_AUTO && cam->tile_order != TILE_ORDER_COST
+    };
+
+    f->ctx = (RenderContext) {
+        .cam = &f->cam,
+        .kernel = render_kernel_select(cam, scene),
+        .scene = scene_retime(scene, interval(cam->time, cam->time + cam->shutter)),
+        .pixels = pixels,
+        .aovs = aovs,
+        .costs = {
+            .width = (cam->image_width + PILOT_BLOCK - 1) / PILOT_BLOCK,
+            .height = (cam->image_height + PILOT_BLOCK - 1) / PILOT_BLOCK
+        }
+    };
+
+    fprintf(stderr, "Kernel: %s\n", f->ctx.kernel->name);
+
+    if (f->ctx.kernel->primary_raster) {
+        double start = clock_ns();
+        f->raster = raster_build(&f->cam, f->ctx.scene, thread_count);
+        f->ctx.frame.raster = &f->raster;
+        fprintf(stderr, "Raster: %d binned references, %d global (%.1f ms)\n",
+            f->raster.bin_start[f->raster.tiles_x * f->raster.tiles_y], f->raster.global_count, (clock_ns() - start) * 1e-6);
+    }
+
+    // Records gathered during the pilot pass are kept for the render pass.
+    if (f->ctx.kernel->irradiance_cache) {
+        f->ctx.frame.irradiance = irradiance_cache_create(cam->irradiance_params);
+    }
+
+    f->block_count = f->ctx.costs.width * f->ctx.costs.height;
+    f->ctx.costs.cost = malloc(f->block_count * sizeof(double));
+
+    if (f->pinned) {
+        for (int b = 0; b < f->block_count; b++) {
+            f->ctx.costs.cost[b] = 1.0;
+        }
+    }
+}
+
+// Times one sample on a sparse subset of the block's pixels.
+void render_frame_pilot(RenderFrame* f, int b) {
+
+    RenderContext* ctx = &f->ctx;
+    const Camera* cam = ctx->cam;
+
+    int x0 = (b % ctx->costs.width) * PILOT_BLOCK;
+    int y0 = (b / ctx->costs.width) * PILOT_BLOCK;
+    int x1 = imin(x0 + PILOT_BLOCK, cam->image_width);
+    int y1 = imin(y0 + PILOT_BLOCK, cam->image_height);
+
+    frand_seed(camera_seed(cam, ~0u, b));
+
+    int count = 0;
+    double start = clock_ns();
+    for (int j = y0; j < y1; j += PILOT_STRIDE) {
+        for (int i = x0; i < x1; i += PILOT_STRIDE) {
+            ctx->kernel->sample(cam, ctx->scene, &ctx->frame, i, j, NULL);
+            count++;
+        }
+    }
+    ctx->costs.cost[b] = (clock_ns() - start) / count;
+}
+
+// Schedules the tiles from the pilot pass's costs and clears the sums.
+void render_frame_schedule(RenderFrame* f, int thread_count, double pilot_ms) {
+
+    const Camera* cam = &f->cam;
+    RenderContext* ctx = &f->ctx;
+    int pixel_count = cam->image_width * cam->image_height;
+
+    f->schedule = schedule_tune(ctx->costs, cam->image_width, cam->image_height, cam->samples_per_pixel,
+        thread_count, cam->tile_size, cam->tile_order, cam->samples_per_task);
+
+    fprintf(stderr, "Schedule: %d threads, %dpx tiles, %s order, %d samples per task, %d/%d tiles split, %d tasks (pilot %.1f ms)\n",
+        thread_count, f->schedule.tile_size, TILE_ORDER_NAMES[f->schedule.order], f->schedule.samples_per_task,
+        f->schedule.split_tiles, f->schedule.tile_count, f->schedule.task_count, pilot_ms);
+
+    ctx->schedule = &f->schedule;
+    ctx->tile_locks = malloc(f->schedule.tile_count * sizeof(pthread_mutex_t));
+    for (int i = 0; i < f->schedule.tile_count; i++) {
+        pthread_mutex_init(&ctx->tile_locks[i], NULL);
+    }
+
+    memset(ctx->pixels, 0, pixel_count * sizeof(vec3));
+    if (ctx->aovs != NULL) {
+        memset(ctx->aovs, 0, pixel_count * sizeof(Aov));
+    }
+}
+
+// Renders task t into local and local_aovs, which hold a tile each, and
+// adds them to the frame's sums.
+void render_frame_task(RenderFrame* f, int t, vec3* local, Aov* local_aovs) {
+
+    RenderContext* ctx = &f->ctx;
+    const Camera* cam = ctx->cam;
+    const RenderTask* task = &f->schedule.tasks[t];
+    int w = task->x1 - task->x0;
+
+    ctx->kernel->render_task(cam, ctx->scene, &ctx->frame, task, local, local_aovs);
+
+    // Tiles split into sample chunks are accumulated by several tasks.
+    pthread_mutex_lock(&ctx->tile_locks[task->tile]);
+    for (int j = task->y0; j < task->y1; ++j) {
+        for (int i = task->x0; i < task->x1; ++i) {
+            vec3* pixel = &ctx->pixels[j * cam->image_width + i];
+            *pixel = vec3_add(*pixel, local[(j - task->y0) * w + (i - task->x0)]);
+            if (local_aovs != NULL) {
+                Aov* aov = &ctx->aovs[j * cam->image_width + i];
+                const Aov* add = &local_aovs[(j - task->y0) * w + (i - task->x0)];
+                aov->albedo = vec3_add(aov->albedo, add->albedo);
+                aov->normal = vec3_add(aov->normal, add->normal);
+                aov->depth += add->depth;
+                aov->luminance += add->luminance;
+                aov->luminance_sq += add->luminance_sq;
+            }
+        }
+    }
+    pthread_mutex_unlock(&ctx->tile_locks[task->tile]);
+}
+
+// Releases everything but the sums, and turns the AOV sums into averages.
+void render_frame_end(RenderFrame* f, double render_ms) {
+
+    const Camera* cam = &f->cam;
+    RenderContext* ctx = &f->ctx;
+    int pixel_count = cam->image_width * cam->image_height;
+
+    // A pinned schedule is built from uniform placeholder costs, not a measured estimate.
+    if (f->pinned) {
+        fprintf(stderr, "Rendered in %.1f ms\n", render_ms);
+    } else {
+        fprintf(stderr, "Rendered in %.1f ms (estimated %.1f ms)\n", render_ms, f->schedule.makespan * 1e-6);
+    }
+
+    for (int i = 0; i < f->schedule.tile_count; i++) {
+        pthread_mutex_destroy(&ctx->tile_locks[i]);
+    }
+    free(ctx->tile_locks);
+    free(ctx->costs.cost);
+    schedule_destroy(f->schedule);
+    if (ctx->frame.raster != NULL) {
+        raster_destroy(f->raster);
+    }
+    for (int c = 0; c < ctx->scene.texture_cache_count; c++) {
+        texture_cache_report(ctx->scene.textures[c], stderr);
+    }
+    if (ctx->frame.irradiance != NULL) {
+        IrradianceCache* cache = ctx->frame.irradiance;
+        fprintf(stderr, "Irradiance cache: %d records, %d/%d lookups missed\n",
+            cache->count, atomic_load(&cache->misses), atomic_load(&cache->lookups));
+        irradiance_cache_destroy(cache);
+    }
+    scene_retime_destroy(ctx->scene, f->scene);
+
+    if (ctx->aovs != NULL) {
+        for (int p = 0; p < pixel_count; p++) {
+            ctx->aovs[p].albedo = vec3_scale(ctx->aovs[p].albedo, 1.0 / cam->samples_per_pixel);
+            ctx->aovs[p].normal = vec3_scale(ctx->aovs[p].normal, 1.0 / cam->samples_per_pixel);
+            ctx->aovs[p].depth /= cam->samples_per_pixel;
+            ctx->aovs[p].luminance /= cam->samples_per_pixel;
+            ctx->aovs[p].luminance_sq /= cam->samples_per_pixel;
+        }
+    }
+}
+
+void* camera_pilot_worker(void* arg) {
+
+    RenderFrame* f = arg;
+
+    for (int b = atomic_fetch_add(&f->ctx.next, 1); b < f->block_count; b = atomic_fetch_add(&f->ctx.next, 1)) {
+        render_frame_pilot(f, b);
+    }
+
+    return NULL;
+}
+
+void* camera_render_worker(void* arg) {
+
+    RenderFrame* f = arg;
+    int tile_pixels = f->schedule.tile_size * f->schedule.tile_size;
+    vec3* local = malloc(tile_pixels * sizeof(vec3));
+    Aov* local_aovs = (f->ctx.aovs != NULL) ? malloc(tile_pixels * sizeof(Aov)) : NULL;
+
+    for (int t = atomic_fetch_add(&f->ctx.next, 1); t < f->schedule.task_count; t = atomic_fetch_add(&f->ctx.next, 1)) {
+        render_frame_task(f, t, local, local_aovs);
+    }
+
+    free(local);
+    free(local_aovs);
+
+    return NULL;
+}
+
+void camera_run_workers(int thread_count, void* (*worker)(void*), RenderFrame* f) {
+    atomic_store(&f->ctx.next, 0);
+    parallel_run(thread_count, worker, f);
+}
+
+// Accumulates the sum of all samples of every pixel, and the per-sample
+// average first-hit features into aovs unless it is NULL. A pilot pass
+// estimates the per-block cost, unless every scheduling parameter is
+// pinned, and the tiles are then scheduled from that estimate.
+void camera_render_pixels(const Camera* cam, Scene scene, vec3* pixels, Aov* aovs) {
+
+    int thread_count = parallel_thread_count(cam->thread_count);
+    RenderFrame f;
+
+    render_frame_begin(&f, cam, scene, pixels, aovs, thread_count);
+
+    double start = clock_ns();
+    if (!f.pinned) {
+        camera_run_workers(thread_count, camera_pilot_worker, &f);
+    }
+    render_frame_schedule(&f, thread_count, (clock_ns() - start) * 1e-6);
+
+    start = clock_ns();
+    camera_run_workers(thread_count, camera_render_worker, &f);
+    render_frame_end(&f, (clock_ns() - start) * 1e-6);
+}
+
+// Denoises the sample sums in pixels, leaving them as sums.
+void camera_denoise(const Camera* cam, vec3* pixels, const Aov* aovs, int thread_count) {
+
+    int pixel_count = cam->image_width * cam->image_height;
+    double start = clock_ns();
+
+    for (int p = 0; p < pixel_count; p++) {
+        pixels[p] = vec3_scale(pixels[p], 1.0 / cam->samples_per_pixel);
+    }
+    denoise(pixels, aovs, cam->image_width, cam->image_height, cam->samples_per_pixel, cam->denoise_params, thread_count);
+    for (int p = 0; p < pixel_count; p++) {
+        pixels[p] = vec3_scale(pixels[p], cam->samples_per_pixel);
+    }
+
+    fprintf(stderr, "Denoised in %.1f ms\n", (clock_ns() - start) * 1e-6);
+}
+
+// Writes the AOVs if requested, denoises, and writes the image to out.
+void camera_write_frame(const Camera* cam, vec3* pixels, const Aov* aovs, FILE* out, int thread_count) {
+    if (cam->aov_path != NULL) {
+        camera_write_aovs(cam, aovs, cam->aov_path);
+    }
+    if (cam->denoise) {
+        camera_denoise(cam, pixels, aovs, thread_count);
+    }
+    camera_write_ppm(cam, pixels, out);
+}
+
+void camera_render_file(Camera* cam, Scene scene, FILE* out) {
+    
+    camera_init(cam);
+
+    int pixel_count = cam->image_width * cam->image_height;
+    vec3* pixels = malloc(pixel_count * sizeof(vec3));
+    Aov* aovs = (cam->denoise || cam->aov_path != NULL) ? malloc(pixel_count * sizeof(Aov)) : NULL;
+
+    camera_render_pixels(cam, scene, pixels, aovs);
+    camera_write_frame(cam, pixels, aovs, out, parallel_thread_count(cam->thread_count));
+
+    free(aovs);
+    free(pixels);
+
+    fprintf(stderr, "Done\n");
+}
+
+void camera_render(Camera* cam, Scene scene) {
+    camera_render_file(cam, scene, stdout);
+}
\ No newline at end of file
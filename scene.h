@@ -6,20 +6,33 @@
 #include "hittable.h"
 #include "hit.h"
 #include "interval.h"
+#include "grid.h"
+
+typedef enum SceneAccel {
+    SCENE_ACCEL_LINEAR,
+    SCENE_ACCEL_GRID
+} SceneAccel;
 
 typedef struct Scene {
     Hittable* hittables;
     int size;
+    SceneAccel accel;
+    Grid* grid;
+    Interval time;     // Ray times the grid bounds moving spheres over, unbounded unless retimed
+    bool moving;       // Some sphere has a velocity
+    Sphere* spheres;   // Packed copies of every sphere when the scene holds nothing else, NULL otherwise
+    TextureCache** textures; // Distinct caches of the materials' image textures, NULL when none is textured
+    int texture_cache_count;
 } Scene;
 
-bool scene_hit(Scene scene, Ray ray, Interval ray_t, Hit* hit) {
+FORCE_INLINE bool scene_hit_linear_kernel(Scene scene, Ray ray, Interval ray_t, Hit* hit, const bool sphere_only) {
 
     Hit temp;
     bool hit_anything = false;
     double closest_so_far = ray_t.max;
 
     for (int i = 0; i < scene.size; i++) {
-        if (hittable_hit(scene.hittables[i], ray, interval(ray_t.min, closest_so_far), &temp)) {
+        if (hittable_hit_indexed(scene.hittables, scene.spheres, i, ray, interval(ray_t.min, closest_so_far), &temp, sphere_only)) {
             hit_anything = true;
             closest_so_far = temp.t;
             *hit = temp;
@@ -29,10 +42,38 @@ bool scene_hit(Scene scene, Ray ray, Interval ray_t, Hit* hit) {
     return hit_anything;
 }
 
+// Traversal with the acceleration structure and primitive types fixed at compile time.
+FORCE_INLINE bool scene_hit_kernel(Scene scene, Ray ray, Interval ray_t, Hit* hit, const SceneAccel accel, const bool sphere_only) {
+    switch (accel) {
+        case SCENE_ACCEL_LINEAR: return scene_hit_linear_kernel(scene, ray, ray_t, hit, sphere_only);
+        case SCENE_ACCEL_GRID: return grid_hit_kernel(scene.grid, scene.hittables, scene.spheres, ray, ray_t, hit, sphere_only);
+    }
+    return false;
+}
+
+bool scene_hit_linear(Scene scene, Ray ray, Interval ray_t, Hit* hit) {
+    return scene_hit_linear_kernel(scene, ray, ray_t, hit, false);
+}
+
+bool scene_hit(Scene scene, Ray ray, Interval ray_t, Hit* hit) {
+    switch (scene.accel) {
+        case SCENE_ACCEL_LINEAR: return scene_hit_linear(scene, ray, ray_t, hit);
+        case SCENE_ACCEL_GRID: return grid_hit(scene.grid, scene.hittables, ray, ray_t, hit);
+    }
+    return false;
+}
+
 Scene scene_create(int size) {
     return (Scene) {
         .hittables = malloc(size * sizeof(Hittable)),
-        .size = 0
+        .size = 0,
+        .accel = SCENE_ACCEL_LINEAR,
+        .grid = NULL,
+        .time = interval_universe,
+        .moving = false,
+        .spheres = NULL,
+        .textures = NULL,
+        .texture_cache_count = 0
     };
 }
 
@@ -40,6 +81,92 @@ void scene_add(Scene* scene, Hittable object) {
     scene->hittables[scene->size++] = object;
 }
 
+// Builds the acceleration structure scene_hit uses, after the last scene_add.
+void scene_build(Scene* scene, SceneAccel accel) {
+
+    if (scene->grid != NULL) {
+        grid_destroy(*scene->grid);
+        free(scene->grid);
+        scene->grid = NULL;
+    }
+
+    free(scene->spheres);
+    scene->spheres = NULL;
+
+    bool sphere_only = scene->size > 0;
+    scene->moving = false;
+    for (int i = 0; i < scene->size; i++) {
+        sphere_only = sphere_only && scene->hittables[i].type == HITTABLE_SPHERE;
+        scene->moving = scene->moving || (scene->hittables[i].type == HITTABLE_SPHERE
+            && !vec3_nearzero(((const Sphere*)scene->hittables[i].object)->velocity));
+    }
+    if (sphere_only) {
+        scene->spheres = malloc(scene->size * sizeof(Sphere));
+        for (int i = 0; i < scene->size; i++) {
+            scene->spheres[i] = *(const Sphere*)scene->hittables[i].object;
+        }
+    }
+
+    // Rays only track their differentials in scenes with textures.
+    free(scene->textures);
+    scene->textures = NULL;
+    scene->texture_cache_count = 0;
+    for (int i = 0; i < scene->size; i++) {
+        const Texture* texture = material_texture(scene->hittables[i].mat);
+        if (texture == NULL) {
+            continue;
+        }
+        int c = 0;
+        while (c < scene->texture_cache_count && scene->textures[c] != texture->cache) {
+            c++;
+        }
+        if (c == scene->texture_cache_count) {
+            if (scene->textures == NULL) {
+                scene->textures = malloc(scene->size * sizeof(TextureCache*));
+            }
+            scene->textures[scene->texture_cache_count++] = texture->cache;
+        }
+    }
+
+    scene->accel = accel;
+
+    if (accel == SCENE_ACCEL_GRID) {
+        scene->grid = malloc(sizeof(Grid));
+        *scene->grid = grid_build(scene->hittables, scene->size, scene->time);
+    }
+}
+
+// Returns the scene with a grid rebuilt for rays with times in time, which
+// bins moving spheres by their swept box instead of testing them on every
+// ray. Everything else is shared with scene, and so is the grid when no
+// sphere moves. Release it with scene_retime_destroy.
+Scene scene_retime(Scene scene, Interval time) {
+
+    if (scene.accel != SCENE_ACCEL_GRID || !scene.moving) {
+        return scene;
+    }
+
+    Scene retimed = scene;
+    retimed.time = time;
+    retimed.grid = malloc(sizeof(Grid));
+    *retimed.grid = grid_build(scene.hittables, scene.size, time);
+
+    return retimed;
+}
+
+void scene_retime_destroy(Scene retimed, Scene scene) {
+    if (retimed.grid != scene.grid) {
+        grid_destroy(*retimed.grid);
+        free(retimed.grid);
+    }
+}
+
 void scene_destroy(Scene scene) {
+    if (scene.grid != NULL) {
+        grid_destroy(*scene.grid);
+        free(scene.grid);
+    }
+    free(scene.spheres);
+    free(scene.textures);
     free(scene.hittables);
 }
\ No newline at end of file
@@ -0,0 +1,333 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "util.h"
+#include "vec3.h"
+#include "scene.h"
+#include "parallel.h"
+#include "render.h"
+
+typedef struct CameraKeyframe {
+    double time;
+    vec3 lookfrom;
+    vec3 lookat;
+    double vfov;
+    double focus_dist;
+} CameraKeyframe;
+
+typedef struct Sequence {
+    const CameraKeyframe* keyframes;  // Sorted by time
+    int keyframe_count;
+    int frame_count;
+    const char* path_format;          // printf format taking the frame number, e.g. "frame_%04d.ppm"
+} Sequence;
+
+double sequence_frame_time(Sequence seq, int frame) {
+    double start = seq.keyframes[0].time;
+    double end = seq.keyframes[seq.keyframe_count - 1].time;
+    if (seq.frame_count <= 1) {
+        return start;
+    }
+    return lerp(start, end, frame / (double)(seq.frame_count - 1));
+}
+
+// Sets the keyframed camera parameters to their values at the given time.
+void camera_keyframe_apply(Camera* cam, const CameraKeyframe* keyframes, int count, double time) {
+
+    int k = 0;
+    while (k < count - 2 && keyframes[k + 1].time <= time) {
+        k++;
+    }
+
+    const CameraKeyframe* a = &keyframes[k];
+    const CameraKeyframe* b = &keyframes[(count > 1) ? k + 1 : k];
+
+    double t = (b->time > a->time) ? clamp01(unlerp(time, a->time, b->time)) : 0.0;
+
+    cam->lookfrom   = vec3_lerp_all(a->lookfrom, b->lookfrom, t);
+    cam->lookat     = vec3_lerp_all(a->lookat, b->lookat, t);
+    cam->vfov       = lerp(a->vfov, b->vfov, t);
+    cam->focus_dist = lerp(a->focus_dist, b->focus_dist, t);
+}
+
+// Accepts formats with exactly one int conversion such as %d or %04d, besides
+// literal %%, so that the frame number is the only argument snprintf reads.
+bool sequence_path_format_valid(const char* format) {
+
+    int conversions = 0;
+
+    for (const char* c = format; *c != '\0'; c++) {
+        if (*c != '%') {
+            continue;
+        }
+        if (*++c == '%') {
+            continue;
+        }
+        while (*c == '-' || *c == '+' || *c == ' ' || *c == '0' || *c == '#') {
+            c++;
+        }
+        while (*c >= '0' && *c <= '9') {
+            c++;
+        }
+        if (*c == '.') {
+            c++;
+            while (*c >= '0' && *c <= '9') {
+                c++;
+            }
+        }
+        if (*c != 'd' && *c != 'i') {
+            return false;
+        }
+        conversions++;
+    }
+
+    return conversions == 1;
+}
+
+typedef enum SequenceStage {
+    SEQUENCE_IDLE,     // Slot free for the next frame
+    SEQUENCE_SETUP,    // Camera, grid, raster and output file being prepared
+    SEQUENCE_PILOT,    // Pilot blocks being handed out
+    SEQUENCE_RENDER,   // Tasks being handed out
+    SEQUENCE_WRITE     // Every task done, the image is being written
+} SequenceStage;
+
+typedef struct SequenceFrame {
+    RenderFrame render;
+    SequenceStage stage;
+    int index;
+    FILE* out;
+    vec3* pixels;
+    Aov* aovs;
+    int next;          // Next pilot block or task to hand out
+    int done;          // Pilot blocks or tasks finished
+    double start;      // Start of the current stage
+} SequenceFrame;
+
+// Two frames in flight, so that one frame's pilot pass, raster setup and
+// grid rebuild run while the other finishes its last tasks and is written.
+#define SEQUENCE_SLOTS 2
+
+typedef struct SequenceContext {
+    const Camera* cam;
+    Scene scene;
+    Sequence seq;
+    int thread_count;
+    SequenceFrame slots[SEQUENCE_SLOTS];
+    int next_frame;    // Next frame to set up
+    bool failed;       // No frame is set up after an output fails to open
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} SequenceContext;
+
+// Opens the frame's output and prepares it for its pilot pass. Runs on one
+// worker while the others render the previous frame, so the raster is built
+// on this thread alone.
+bool sequence_frame_setup(SequenceContext* sc, SequenceFrame* f) {
+
+    char path[4096];
+    snprintf(path, sizeof(path), sc->seq.path_format, f->index);
+    f->out = fopen(path, "w");
+    if (f->out == NULL) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return false;
+    }
+
+    fprintf(stderr, "Frame %d/%d: %s\n", f->index + 1, sc->seq.frame_count, path);
+
+    double time = sequence_frame_time(sc->seq, f->index);
+    Camera cam = *sc->cam;
+    camera_keyframe_apply(&cam, sc->seq.keyframes, sc->seq.keyframe_count, time);
+    cam.time = time;
+    camera_init(&cam);
+
+    int pixel_count = cam.image_width * cam.image_height;
+    f->pixels = malloc(pixel_count * sizeof(vec3));
+    f->aovs = (cam.denoise || cam.aov_path != NULL) ? malloc(pixel_count * sizeof(Aov)) : NULL;
+
+    render_frame_begin(&f->render, &cam, sc->scene, f->pixels, f->aovs, 1);
+
+    return true;
+}
+
+// Denoises and writes the frame once its last task is done. Runs on one
+// worker while the others start on the next frame.
+void sequence_frame_write(SequenceFrame* f) {
+
+    const Camera* cam = &f->render.cam;
+
+    render_frame_end(&f->render, (clock_ns() - f->start) * 1e-6);
+    camera_write_frame(cam, f->pixels, f->aovs, f->out, 1);
+
+    fclose(f->out);
+    free(f->aovs);
+    free(f->pixels);
+
+    fprintf(stderr, "Frame %d written\n", f->index + 1);
+}
+
+// The oldest frame in the given stage with pilot blocks or tasks left to
+// hand out, NULL if there is none.
+SequenceFrame* sequence_pending(SequenceContext* sc, SequenceStage stage) {
+    SequenceFrame* oldest = NULL;
+    for (int s = 0; s < SEQUENCE_SLOTS; s++) {
+        SequenceFrame* f = &sc->slots[s];
+        int count = (stage == SEQUENCE_PILOT) ? f->render.block_count : f->render.schedule.task_count;
+        if (f->stage == stage && f->next < count && (oldest == NULL || f->index < oldest->index)) {
+            oldest = f;
+        }
+    }
+    return oldest;
+}
+
+// A free slot, NULL if every slot holds a frame.
+SequenceFrame* sequence_idle(SequenceContext* sc) {
+    for (int s = 0; s < SEQUENCE_SLOTS; s++) {
+        if (sc->slots[s].stage == SEQUENCE_IDLE) {
+            return &sc->slots[s];
+        }
+    }
+    return NULL;
+}
+
+int sequence_in_flight(SequenceContext* sc) {
+    int count = 0;
+    for (int s = 0; s < SEQUENCE_SLOTS; s++) {
+        count += sc->slots[s].stage != SEQUENCE_IDLE;
+    }
+    return count;
+}
+
+// Every worker takes the oldest frame's next task first, then the next
+// frame's pilot blocks, and sets up a frame when a slot is free, so a
+// frame's tail and write overlap the next frame's setup and pilot pass.
+// The worker that finishes a frame's last pilot block schedules it, and
+// the one that finishes its last task writes it.
+void* camera_sequence_worker(void* arg) {
+
+    SequenceContext* sc = arg;
+    vec3* local = NULL;
+    Aov* local_aovs = NULL;
+    int capacity = 0;
+
+    pthread_mutex_lock(&sc->lock);
+
+    for (;;) {
+
+        SequenceFrame* f;
+
+        if ((f = sequence_pending(sc, SEQUENCE_RENDER)) != NULL) {
+
+            int t = f->next++;
+            pthread_mutex_unlock(&sc->lock);
+
+            int tile_pixels = f->render.schedule.tile_size * f->render.schedule.tile_size;
+            if (tile_pixels > capacity) {
+                capacity = tile_pixels;
+                local = realloc(local, capacity * sizeof(vec3));
+                local_aovs = realloc(local_aovs, capacity * sizeof(Aov));
+            }
+            render_frame_task(&f->render, t, local, (f->aovs != NULL) ? local_aovs : NULL);
+
+            pthread_mutex_lock(&sc->lock);
+            if (++f->done == f->render.schedule.task_count) {
+                f->stage = SEQUENCE_WRITE;
+                pthread_mutex_unlock(&sc->lock);
+                sequence_frame_write(f);
+                pthread_mutex_lock(&sc->lock);
+                f->stage = SEQUENCE_IDLE;
+                pthread_cond_broadcast(&sc->changed);
+            }
+
+        } else if ((f = sequence_pending(sc, SEQUENCE_PILOT)) != NULL) {
+
+            int b = f->next++;
+            pthread_mutex_unlock(&sc->lock);
+
+            render_frame_pilot(&f->render, b);
+
+            pthread_mutex_lock(&sc->lock);
+            if (++f->done == f->render.block_count) {
+                pthread_mutex_unlock(&sc->lock);
+                render_frame_schedule(&f->render, sc->thread_count, (clock_ns() - f->start) * 1e-6);
+                pthread_mutex_lock(&sc->lock);
+                f->stage = SEQUENCE_RENDER;
+                f->next = f->done = 0;
+                f->start = clock_ns();
+                pthread_cond_broadcast(&sc->changed);
+            }
+
+        } else if (!sc->failed && sc->next_frame < sc->seq.frame_count
+            && (f = sequence_idle(sc)) != NULL) {
+
+            f->stage = SEQUENCE_SETUP;
+            f->index = sc->next_frame++;
+            pthread_mutex_unlock(&sc->lock);
+
+            bool ok = sequence_frame_setup(sc, f);
+            if (ok && f->render.pinned) {
+                render_frame_schedule(&f->render, sc->thread_count, 0.0);
+            }
+
+            pthread_mutex_lock(&sc->lock);
+            if (ok) {
+                f->stage = f->render.pinned ? SEQUENCE_RENDER : SEQUENCE_PILOT;
+                f->next = f->done = 0;
+                f->start = clock_ns();
+            } else {
+                f->stage = SEQUENCE_IDLE;
+                sc->failed = true;
+            }
+            pthread_cond_broadcast(&sc->changed);
+
+        } else if (sequence_in_flight(sc) == 0) {
+            break;
+        } else {
+            pthread_cond_wait(&sc->changed, &sc->lock);
+        }
+    }
+
+    pthread_mutex_unlock(&sc->lock);
+
+    free(local);
+    free(local_aovs);
+
+    return NULL;
+}
+
+// Renders every frame of the sequence in this process, reusing the scene
+// across frames and pipelining consecutive frames on the thread pool. Ray
+// times start at each frame's time, so moving spheres advance between
+// frames and blur within a frame when cam->shutter > 0, and each frame's
+// grid is rebuilt around the boxes they sweep while its shutter is open.
+bool camera_render_sequence(const Camera* cam, Scene scene, Sequence seq) {
+
+    if (!sequence_path_format_valid(seq.path_format)) {
+        fprintf(stderr, "Path format %s must contain exactly one integer conversion such as %%04d\n", seq.path_format);
+        return false;
+    }
+
+    SequenceContext sc = {
+        .cam = cam,
+        .scene = scene,
+        .seq = seq,
+        .thread_count = parallel_thread_count(cam->thread_count),
+        .next_frame = 0,
+        .failed = false
+    };
+    for (int s = 0; s < SEQUENCE_SLOTS; s++) {
+        sc.slots[s].stage = SEQUENCE_IDLE;
+    }
+    pthread_mutex_init(&sc.lock, NULL);
+    pthread_cond_init(&sc.changed, NULL);
+
+    parallel_run(sc.thread_count, camera_sequence_worker, &sc);
+
+    pthread_cond_destroy(&sc.changed);
+    pthread_mutex_destroy(&sc.lock);
+
+    return !sc.failed;
+}
@@ -0,0 +1,525 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "util.h"
+#include "vec3.h"
+
+#define TEXTURE_TILE 32          // Texels per tile side
+#define TEXTURE_MAX_LEVELS 24
+// Largest side whose mip chain fits in TEXTURE_MAX_LEVELS.
+#define TEXTURE_MAX_SIZE (1 << (TEXTURE_MAX_LEVELS - 1))
+#define TEXTURE_CACHE_SHARDS 16  // Independently locked slices of the cache
+
+#define TEXTURE_TILE_TEXELS (TEXTURE_TILE * TEXTURE_TILE)
+
+static const char TEXTURE_MAGIC[8] = "RTTEX01";
+
+// File layout written by texture_convert: this header, then every tile of
+// every mip level, finest first and row-major within a level. Tiles hold
+// gamma encoded 8-bit RGB and are padded with their edge texels.
+typedef struct TextureHeader {
+    char magic[8];
+    int32_t width, height;
+    int32_t level_count;
+    int32_t tile;
+} TextureHeader;
+
+typedef struct TextureLevel {
+    int width, height;
+    int tiles_x, tiles_y;
+    int64_t first_tile;   // Index of the level's first tile in the file
+} TextureLevel;
+
+typedef struct TextureCache TextureCache;
+
+// Tiled, mip-mapped image whose tiles are read on demand through a TextureCache.
+typedef struct Texture {
+    TextureCache* cache;
+    int id;
+    int fd;
+    int level_count;
+    TextureLevel levels[TEXTURE_MAX_LEVELS];
+} Texture;
+
+typedef struct TextureCacheSlot {
+    uint64_t key;
+    int prev, next;       // LRU order, most recently used first
+    int chain;            // Next slot in the same hash chain
+    float* texels;        // Linear RGB
+} TextureCacheSlot;
+
+typedef struct TextureCacheShard {
+    pthread_mutex_t lock;
+    TextureCacheSlot* slots;
+    int capacity;
+    int used;
+    int* table;           // Hash chain heads, -1 when empty
+    int table_size;
+    int head, tail;
+} TextureCacheShard;
+
+// Fixed number of decoded tiles shared by every texture and thread. Tiles
+// are spread over shards by key so that threads rarely wait for each other,
+// and each shard evicts its least recently used tile on a miss.
+struct TextureCache {
+    TextureCacheShard shards[TEXTURE_CACHE_SHARDS];
+    float* storage;
+    int texture_count;
+    atomic_llong hits;
+    atomic_llong misses;
+};
+
+// Holds at most max_bytes of decoded tiles, and at least one tile per shard.
+TextureCache* texture_cache_create(size_t max_bytes) {
+
+    size_t tile_bytes = TEXTURE_TILE_TEXELS * 3 * sizeof(float);
+    int per_shard = imax(1, (int)(max_bytes / tile_bytes / TEXTURE_CACHE_SHARDS));
+
+    TextureCache* cache = malloc(sizeof(TextureCache));
+    cache->storage = malloc((size_t)per_shard * TEXTURE_CACHE_SHARDS * tile_bytes);
+    cache->texture_count = 0;
+    atomic_store(&cache->hits, 0);
+    atomic_store(&cache->misses, 0);
+
+    for (int s = 0; s < TEXTURE_CACHE_SHARDS; s++) {
+
+        TextureCacheShard* shard = &cache->shards[s];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->capacity = per_shard;
+        shard->used = 0;
+        shard->head = -1;
+        shard->tail = -1;
+        shard->slots = malloc(per_shard * sizeof(TextureCacheSlot));
+        for (int i = 0; i < per_shard; i++) {
+            shard->slots[i].texels = cache->storage + ((size_t)s * per_shard + i) * TEXTURE_TILE_TEXELS * 3;
+        }
+
+        shard->table_size = 1;
+        while (shard->table_size < 2 * per_shard) {
+            shard->table_size *= 2;
+        }
+        shard->table = malloc(shard->table_size * sizeof(int));
+        for (int i = 0; i < shard->table_size; i++) {
+            shard->table[i] = -1;
+        }
+    }
+
+    return cache;
+}
+
+void texture_cache_destroy(TextureCache* cache) {
+    for (int s = 0; s < TEXTURE_CACHE_SHARDS; s++) {
+        pthread_mutex_destroy(&cache->shards[s].lock);
+        free(cache->shards[s].slots);
+        free(cache->shards[s].table);
+    }
+    free(cache->storage);
+    free(cache);
+}
+
+int texture_cache_resident(const TextureCache* cache) {
+    int resident = 0;
+    for (int s = 0; s < TEXTURE_CACHE_SHARDS; s++) {
+        resident += cache->shards[s].used;
+    }
+    return resident;
+}
+
+void texture_cache_report(TextureCache* cache, FILE* out) {
+    long long hits = atomic_load(&cache->hits);
+    long long misses = atomic_load(&cache->misses);
+    int resident = texture_cache_resident(cache);
+    fprintf(out, "Texture cache: %lld hits, %lld misses (%.2f%%), %d/%d tiles resident (%.1f MB)\n",
+        hits, misses, 100.0 * misses / fmax(hits + misses, 1.0),
+        resident, cache->shards[0].capacity * TEXTURE_CACHE_SHARDS,
+        resident * TEXTURE_TILE_TEXELS * 3.0 * sizeof(float) / (1 << 20));
+}
+
+uint64_t texture_key(const Texture* tex, int level, int tx, int ty) {
+    return (uint64_t)tex->id << 48 | (uint64_t)level << 40 | (uint64_t)ty << 20 | (uint64_t)tx;
+}
+
+uint64_t texture_key_hash(uint64_t key) {
+    key ^= key >> 29;
+    key *= 0xBF58476D1CE4E5B9ull;
+    return key ^ (key >> 32);
+}
+
+void texture_lru_unlink(TextureCacheShard* shard, int i) {
+    TextureCacheSlot* slot = &shard->slots[i];
+    if (slot->prev >= 0) shard->slots[slot->prev].next = slot->next; else shard->head = slot->next;
+    if (slot->next >= 0) shard->slots[slot->next].prev = slot->prev; else shard->tail = slot->prev;
+}
+
+void texture_lru_push(TextureCacheShard* shard, int i) {
+    TextureCacheSlot* slot = &shard->slots[i];
+    slot->prev = -1;
+    slot->next = shard->head;
+    if (shard->head >= 0) shard->slots[shard->head].prev = i; else shard->tail = i;
+    shard->head = i;
+}
+
+// Reads a tile from the file and decodes it to linear RGB, magenta if the read fails.
+void texture_load_tile(const Texture* tex, int level, int tx, int ty, float* texels) {
+
+    uint8_t encoded[TEXTURE_TILE_TEXELS * 3];
+    const TextureLevel* l = &tex->levels[level];
+    int64_t index = l->first_tile + (int64_t)ty * l->tiles_x + tx;
+    off_t offset = sizeof(TextureHeader) + index * (off_t)sizeof(encoded);
+
+    if (pread(tex->fd, encoded, sizeof(encoded), offset) != (ssize_t)sizeof(encoded)) {
+        for (int i = 0; i < TEXTURE_TILE_TEXELS; i++) {
+            texels[3 * i + 0] = 1.0f;
+            texels[3 * i + 1] = 0.0f;
+            texels[3 * i + 2] = 1.0f;
+        }
+        return;
+    }
+
+    // Inverse of the gamma 2 in color.h.
+    for (int i = 0; i < TEXTURE_TILE_TEXELS * 3; i++) {
+        float c = encoded[i] / 255.0f;
+        texels[i] = c * c;
+    }
+}
+
+// Returns the texels of a tile with its shard locked, loading the tile over
+// the shard's least recently used one on a miss. Release with texture_tile_unlock.
+const float* texture_tile_lock(const Texture* tex, int level, int tx, int ty, TextureCacheShard** locked) {
+
+    TextureCache* cache = tex->cache;
+    uint64_t key = texture_key(tex, level, tx, ty);
+    uint64_t hash = texture_key_hash(key);
+    TextureCacheShard* shard = &cache->shards[hash % TEXTURE_CACHE_SHARDS];
+    int bucket = (hash / TEXTURE_CACHE_SHARDS) & (shard->table_size - 1);
+
+    pthread_mutex_lock(&shard->lock);
+    *locked = shard;
+
+    for (int i = shard->table[bucket]; i >= 0; i = shard->slots[i].chain) {
+        if (shard->slots[i].key == key) {
+            atomic_fetch_add_explicit(&cache->hits, 1, memory_order_relaxed);
+            if (shard->head != i) {
+                texture_lru_unlink(shard, i);
+                texture_lru_push(shard, i);
+            }
+            return shard->slots[i].texels;
+        }
+    }
+
+    atomic_fetch_add_explicit(&cache->misses, 1, memory_order_relaxed);
+
+    int i;
+    if (shard->used < shard->capacity) {
+        i = shard->used++;
+    } else {
+        i = shard->tail;
+        texture_lru_unlink(shard, i);
+        int old_bucket = (texture_key_hash(shard->slots[i].key) / TEXTURE_CACHE_SHARDS) & (shard->table_size - 1);
+        int* link = &shard->table[old_bucket];
+        while (*link != i) {
+            link = &shard->slots[*link].chain;
+        }
+        *link = shard->slots[i].chain;
+    }
+
+    TextureCacheSlot* slot = &shard->slots[i];
+    slot->key = key;
+    slot->chain = shard->table[bucket];
+    shard->table[bucket] = i;
+    texture_lru_push(shard, i);
+
+    texture_load_tile(tex, level, tx, ty, slot->texels);
+
+    return slot->texels;
+}
+
+void texture_tile_unlock(TextureCacheShard* shard) {
+    pthread_mutex_unlock(&shard->lock);
+}
+
+// Bilinearly filtered texel of a mip level, wrapping around at the edges.
+vec3 texture_bilinear(const Texture* tex, int level, double u, double v) {
+
+    const TextureLevel* l = &tex->levels[level];
+    double x = (u - floor(u)) * l->width - 0.5;
+    double y = (1.0 - (v - floor(v))) * l->height - 0.5;
+    int x0 = (int)floor(x);
+    int y0 = (int)floor(y);
+    double fx = x - x0;
+    double fy = y - y0;
+
+    vec3 sum = vec3_all(0.0);
+    TextureCacheShard* shard = NULL;
+    const float* texels = NULL;
+    int held_tx = -1, held_ty = -1;
+
+    for (int k = 0; k < 4; k++) {
+
+        int xi = (x0 + (k & 1) + l->width) % l->width;
+        int yi = (y0 + (k >> 1) + l->height) % l->height;
+        int tx = xi / TEXTURE_TILE;
+        int ty = yi / TEXTURE_TILE;
+
+        // The four texels usually share a tile, which then stays locked.
+        if (tx != held_tx || ty != held_ty) {
+            if (shard != NULL) {
+                texture_tile_unlock(shard);
+            }
+            texels = texture_tile_lock(tex, level, tx, ty, &shard);
+            held_tx = tx;
+            held_ty = ty;
+        }
+
+        const float* t = &texels[3 * ((yi % TEXTURE_TILE) * TEXTURE_TILE + xi % TEXTURE_TILE)];
+        double w = ((k & 1) ? fx : 1.0 - fx) * ((k >> 1) ? fy : 1.0 - fy);
+        sum = vec3_add(sum, vec3_scale((vec3) { t[0], t[1], t[2] }, w));
+    }
+
+    texture_tile_unlock(shard);
+
+    return sum;
+}
+
+// Trilinear lookup, the mip level is chosen from the texel footprint of
+// the derivatives of (u, v) across a pixel. Zero derivatives read level 0.
+vec3 texture_sample(const Texture* tex, double u, double v, double dudx, double dvdx, double dudy, double dvdy) {
+
+    double w = tex->levels[0].width;
+    double h = tex->levels[0].height;
+    double width = fmax(hypot(dudx * w, dvdx * h), hypot(dudy * w, dvdy * h));
+    double lod = clamp(log2(fmax(width, 1e-8)), 0.0, tex->level_count - 1);
+
+    int level = (int)lod;
+    double f = lod - level;
+    vec3 color = texture_bilinear(tex, level, u, v);
+
+    if (f > 0.0 && level + 1 < tex->level_count) {
+        color = vec3_add(vec3_scale(color, 1.0 - f), vec3_scale(texture_bilinear(tex, level + 1, u, v), f));
+    }
+
+    return color;
+}
+
+// Opens a file written by texture_convert, only its header is read up front.
+Texture* texture_open(TextureCache* cache, const char* path) {
+
+    int fd = open(path, O_RDONLY);
+    TextureHeader header;
+
+    if (fd < 0 || pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)
+        || memcmp(header.magic, TEXTURE_MAGIC, sizeof(TEXTURE_MAGIC)) != 0
+        || header.tile != TEXTURE_TILE || header.level_count < 1 || header.level_count > TEXTURE_MAX_LEVELS
+        || header.width < 1 || header.width > TEXTURE_MAX_SIZE || header.height < 1 || header.height > TEXTURE_MAX_SIZE) {
+        fprintf(stderr, "Could not open texture %s\n", path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+
+    Texture* tex = malloc(sizeof(Texture));
+    tex->cache = cache;
+    tex->fd = fd;
+    tex->level_count = header.level_count;
+
+    int width = header.width;
+    int height = header.height;
+    int64_t first_tile = 0;
+
+    for (int l = 0; l < tex->level_count; l++) {
+        TextureLevel* level = &tex->levels[l];
+        level->width = width;
+        level->height = height;
+        level->tiles_x = (width + TEXTURE_TILE - 1) / TEXTURE_TILE;
+        level->tiles_y = (height + TEXTURE_TILE - 1) / TEXTURE_TILE;
+        level->first_tile = first_tile;
+        first_tile += (int64_t)level->tiles_x * level->tiles_y;
+        width = imax(1, (width + 1) / 2);
+        height = imax(1, (height + 1) / 2);
+    }
+
+    // Every tile must be in the file, so that reading one during the render cannot fail.
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(TextureHeader) + first_tile * (off_t)(TEXTURE_TILE_TEXELS * 3)) {
+        fprintf(stderr, "Truncated texture %s\n", path);
+        close(fd);
+        free(tex);
+        return NULL;
+    }
+
+    tex->id = cache->texture_count++;
+    return tex;
+}
+
+// Tiles of a closed texture stay cached until they are evicted.
+void texture_close(Texture* tex) {
+    close(tex->fd);
+    free(tex);
+}
+
+// Reads the next header field of a PPM, skipping whitespace and comments.
+bool ppm_read_int(FILE* in, int* value) {
+    int c;
+    while ((c = fgetc(in)) != EOF) {
+        if (c == '#') {
+            while ((c = fgetc(in)) != EOF && c != '\n');
+        } else if (c != ' ' && c != '\t' && c != '\n' && c != '\r') {
+            ungetc(c, in);
+            return fscanf(in, "%d", value) == 1;
+        }
+    }
+    return false;
+}
+
+// Reads a plain (P3) or binary (P6) PPM into linear RGB.
+float* ppm_read(const char* path, int* width, int* height) {
+
+    FILE* in = fopen(path, "rb");
+    if (in == NULL) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return NULL;
+    }
+
+    char magic[3] = { 0 };
+    int maxval;
+    if (fread(magic, 1, 2, in) != 2 || (strcmp(magic, "P3") != 0 && strcmp(magic, "P6") != 0)
+        || !ppm_read_int(in, width) || !ppm_read_int(in, height) || !ppm_read_int(in, &maxval)
+        || *width <= 0 || *height <= 0 || maxval <= 0 || maxval > 255) {
+        fprintf(stderr, "Unsupported image %s\n", path);
+        fclose(in);
+        return NULL;
+    }
+    fgetc(in);
+
+    // Checked before allocating, the header alone may ask for terabytes.
+    if (*width > TEXTURE_MAX_SIZE || *height > TEXTURE_MAX_SIZE) {
+        fprintf(stderr, "%s is larger than %d texels on a side\n", path, TEXTURE_MAX_SIZE);
+        fclose(in);
+        return NULL;
+    }
+
+    size_t count = (size_t)*width * *height * 3;
+    float* texels = malloc(count * sizeof(float));
+    if (texels == NULL) {
+        fprintf(stderr, "Not enough memory for %s\n", path);
+        fclose(in);
+        return NULL;
+    }
+    bool binary = magic[1] == '6';
+
+    for (size_t i = 0; i < count; i++) {
+        int value = 0;
+        if (binary ? (value = fgetc(in)) == EOF : !ppm_read_int(in, &value)) {
+            fprintf(stderr, "Truncated image %s\n", path);
+            free(texels);
+            fclose(in);
+            return NULL;
+        }
+        float c = (float)value / maxval;
+        texels[i] = c * c;
+    }
+
+    fclose(in);
+    return texels;
+}
+
+// Converts a PPM into the tiled mip-mapped texture format, each level box
+// filtering the previous one in linear space. Only the conversion holds the
+// whole image in memory, rendering reads tiles on demand.
+bool texture_convert(const char* image_path, const char* texture_path) {
+
+    int width, height;
+    float* level = ppm_read(image_path, &width, &height);
+    if (level == NULL) {
+        return false;
+    }
+
+    FILE* out = fopen(texture_path, "wb");
+    if (out == NULL) {
+        fprintf(stderr, "Could not open %s\n", texture_path);
+        free(level);
+        return false;
+    }
+
+    TextureHeader header = { .width = width, .height = height, .level_count = 1, .tile = TEXTURE_TILE };
+    memcpy(header.magic, TEXTURE_MAGIC, sizeof(TEXTURE_MAGIC));
+    for (int w = width, h = height; (w > 1 || h > 1) && header.level_count < TEXTURE_MAX_LEVELS; header.level_count++) {
+        w = imax(1, (w + 1) / 2);
+        h = imax(1, (h + 1) / 2);
+    }
+    fwrite(&header, sizeof(header), 1, out);
+
+    uint8_t tile[TEXTURE_TILE_TEXELS * 3];
+
+    for (int l = 0; l < header.level_count; l++) {
+
+        int tiles_x = (width + TEXTURE_TILE - 1) / TEXTURE_TILE;
+        int tiles_y = (height + TEXTURE_TILE - 1) / TEXTURE_TILE;
+
+        for (int ty = 0; ty < tiles_y; ty++) {
+            for (int tx = 0; tx < tiles_x; tx++) {
+                for (int y = 0; y < TEXTURE_TILE; y++) {
+                    for (int x = 0; x < TEXTURE_TILE; x++) {
+                        int sx = imin(tx * TEXTURE_TILE + x, width - 1);
+                        int sy = imin(ty * TEXTURE_TILE + y, height - 1);
+                        for (int c = 0; c < 3; c++) {
+                            double encoded = sqrt(level[((size_t)sy * width + sx) * 3 + c]);
+                            tile[(y * TEXTURE_TILE + x) * 3 + c] = (uint8_t)clamp(encoded * 255.0 + 0.5, 0.0, 255.0);
+                        }
+                    }
+                }
+                fwrite(tile, sizeof(tile), 1, out);
+            }
+        }
+
+        int next_width = imax(1, (width + 1) / 2);
+        int next_height = imax(1, (height + 1) / 2);
+        float* next = malloc((size_t)next_width * next_height * 3 * sizeof(float));
+        if (next == NULL) {
+            fprintf(stderr, "Not enough memory for %s\n", image_path);
+            free(level);
+            fclose(out);
+            remove(texture_path);
+            return false;
+        }
+
+        for (int y = 0; y < next_height; y++) {
+            for (int x = 0; x < next_width; x++) {
+                for (int c = 0; c < 3; c++) {
+                    double sum = 0.0;
+                    for (int k = 0; k < 4; k++) {
+                        int sx = imin(2 * x + (k & 1), width - 1);
+                        int sy = imin(2 * y + (k >> 1), height - 1);
+                        sum += level[((size_t)sy * width + sx) * 3 + c];
+                    }
+                    next[((size_t)y * next_width + x) * 3 + c] = sum * 0.25;
+                }
+            }
+        }
+
+        free(level);
+        level = next;
+        width = next_width;
+        height = next_height;
+    }
+
+    free(level);
+
+    bool ok = !ferror(out);
+    fclose(out);
+    if (!ok) {
+        fprintf(stderr, "Could not write %s\n", texture_path);
+    }
+    return ok;
+}
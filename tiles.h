@@ -0,0 +1,261 @@
+#pragma once
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "util.h"
+
+// Side of the square pixel blocks the pilot pass measures, tile sizes are multiples of it.
+#define PILOT_BLOCK 8
+
+// Estimated fixed cost of fetching, seeding and merging one task.
+static const double TASK_OVERHEAD_NS = 5000.0;
+
+typedef enum TileOrder {
+    TILE_ORDER_AUTO,
+    TILE_ORDER_SCANLINE,
+    TILE_ORDER_MORTON,
+    TILE_ORDER_HILBERT,
+    TILE_ORDER_COST       // Most expensive tiles first
+} TileOrder;
+
+static const char* const TILE_ORDER_NAMES[] = {
+    [TILE_ORDER_AUTO]     = "auto",
+    [TILE_ORDER_SCANLINE] = "scanline",
+    [TILE_ORDER_MORTON]   = "morton",
+    [TILE_ORDER_HILBERT]  = "hilbert",
+    [TILE_ORDER_COST]     = "cost",
+};
+
+typedef struct RenderTask {
+    int tile;
+    int x0, y0, x1, y1;
+    int sample_begin, sample_end;
+    double cost;          // Estimated ns
+} RenderTask;
+
+typedef struct TileSchedule {
+    int tile_size;
+    TileOrder order;
+    int samples_per_task;  // Smallest sample chunk of any task
+    int split_tiles;       // Tiles rendered by more than one task
+    int tile_count;
+    int task_count;
+    RenderTask* tasks;
+    double makespan;       // Estimated ns
+} TileSchedule;
+
+// Per-sample cost of every PILOT_BLOCK sized block, measured by the pilot pass.
+typedef struct CostMap {
+    int width, height;     // In blocks
+    double* cost;          // ns per pixel sample
+} CostMap;
+
+uint32_t morton_index(uint32_t x, uint32_t y) {
+    uint32_t d = 0;
+    for (int i = 0; i < 16; i++) {
+        d |= ((x >> i) & 1u) << (2 * i);
+        d |= ((y >> i) & 1u) << (2 * i + 1);
+    }
+    return d;
+}
+
+uint32_t hilbert_index(uint32_t n, uint32_t x, uint32_t y) {
+    uint32_t d = 0;
+    for (uint32_t s = n / 2; s > 0; s /= 2) {
+        uint32_t rx = (x & s) > 0;
+        uint32_t ry = (y & s) > 0;
+        d += s * s * ((3 * rx) ^ ry);
+        if (ry == 0) {
+            if (rx == 1) {
+                x = s - 1 - x;
+                y = s - 1 - y;
+            }
+            uint32_t t = x;
+            x = y;
+            y = t;
+        }
+    }
+    return d;
+}
+
+typedef struct TileKey {
+    double key;
+    int index;
+} TileKey;
+
+int tile_key_compare(const void* a, const void* b) {
+    const TileKey* ka = a;
+    const TileKey* kb = b;
+    if (ka->key != kb->key) {
+        return (ka->key < kb->key) ? -1 : 1;
+    }
+    return ka->index - kb->index;
+}
+
+double cost_map_region(CostMap map, int x0, int y0, int x1, int y1) {
+    double cost = 0.0;
+    for (int by = y0 / PILOT_BLOCK; by * PILOT_BLOCK < y1 && by < map.height; by++) {
+        for (int bx = x0 / PILOT_BLOCK; bx * PILOT_BLOCK < x1 && bx < map.width; bx++) {
+            int w = imin(x1, (bx + 1) * PILOT_BLOCK) - imax(x0, bx * PILOT_BLOCK);
+            int h = imin(y1, (by + 1) * PILOT_BLOCK) - imax(y0, by * PILOT_BLOCK);
+            cost += map.cost[by * map.width + bx] * w * h;
+        }
+    }
+    return cost;
+}
+
+// Greedy list scheduling of the tasks in order onto the threads, as the worker queue does.
+double schedule_simulate(const RenderTask* tasks, int count, int threads) {
+    double* finish = calloc(threads, sizeof(double));
+    double makespan = 0.0;
+    for (int i = 0; i < count; i++) {
+        int earliest = 0;
+        for (int t = 1; t < threads; t++) {
+            if (finish[t] < finish[earliest]) {
+                earliest = t;
+            }
+        }
+        finish[earliest] += tasks[i].cost + TASK_OVERHEAD_NS;
+        makespan = fmax(makespan, finish[earliest]);
+    }
+    free(finish);
+    return makespan;
+}
+
+// Splits the image into tiles visited in the given order. Tiles whose cost
+// would dominate a thread's share are split into sample chunks, unless
+// samples_per_task fixes the chunk size.
+TileSchedule schedule_build(CostMap map, int width, int height, int samples, int threads, int tile_size, TileOrder order, int samples_per_task) {
+
+    int nx = (width + tile_size - 1) / tile_size;
+    int ny = (height + tile_size - 1) / tile_size;
+    int tile_count = nx * ny;
+
+    uint32_t n = 1;
+    while (n < (uint32_t)imax(nx, ny)) {
+        n *= 2;
+    }
+
+    TileKey* keys = malloc(tile_count * sizeof(TileKey));
+    double* tile_cost = malloc(tile_count * sizeof(double));
+    double total = 0.0;
+
+    for (int ty = 0; ty < ny; ty++) {
+        for (int tx = 0; tx < nx; tx++) {
+            int i = ty * nx + tx;
+            tile_cost[i] = samples * cost_map_region(map, tx * tile_size, ty * tile_size,
+                imin((tx + 1) * tile_size, width), imin((ty + 1) * tile_size, height));
+            total += tile_cost[i];
+            keys[i].index = i;
+            switch (order) {
+                case TILE_ORDER_SCANLINE: keys[i].key = i; break;
+                case TILE_ORDER_MORTON: keys[i].key = morton_index(tx, ty); break;
+                case TILE_ORDER_HILBERT: keys[i].key = hilbert_index(n, tx, ty); break;
+                case TILE_ORDER_AUTO:
+                case TILE_ORDER_COST: keys[i].key = -tile_cost[i]; break;
+            }
+        }
+    }
+
+    qsort(keys, tile_count, sizeof(TileKey), tile_key_compare);
+
+    // A single thread has no tail to balance, so its tiles are never split.
+    double target = (threads > 1) ? total / (threads * 16.0) : 0.0;
+
+    TileSchedule schedule = {
+        .tile_size = tile_size,
+        .order = order,
+        .samples_per_task = samples,
+        .split_tiles = 0,
+        .tile_count = tile_count,
+        .task_count = 0,
+        .tasks = malloc(tile_count * sizeof(RenderTask))
+    };
+    int capacity = tile_count;
+
+    for (int k = 0; k < tile_count; k++) {
+
+        int i = keys[k].index;
+        int tx = i % nx;
+        int ty = i / nx;
+
+        int chunk = samples_per_task;
+        if (chunk <= 0) {
+            int chunks = (target > 0.0) ? imin(samples, (int)ceil(tile_cost[i] / target)) : 1;
+            chunk = (samples + imax(chunks, 1) - 1) / imax(chunks, 1);
+        }
+        chunk = imin(imax(chunk, 1), samples);
+
+        if (chunk < samples) {
+            schedule.split_tiles++;
+        }
+        schedule.samples_per_task = imin(schedule.samples_per_task, chunk);
+
+        for (int s = 0; s < samples; s += chunk) {
+            int e = imin(s + chunk, samples);
+            if (schedule.task_count == capacity) {
+                capacity *= 2;
+                schedule.tasks = realloc(schedule.tasks, capacity * sizeof(RenderTask));
+            }
+            schedule.tasks[schedule.task_count++] = (RenderTask) {
+                .tile = i,
+                .x0 = tx * tile_size,
+                .y0 = ty * tile_size,
+                .x1 = imin((tx + 1) * tile_size, width),
+                .y1 = imin((ty + 1) * tile_size, height),
+                .sample_begin = s,
+                .sample_end = e,
+                .cost = tile_cost[i] * (e - s) / samples
+            };
+        }
+    }
+
+    schedule.makespan = schedule_simulate(schedule.tasks, schedule.task_count, threads);
+
+    free(keys);
+    free(tile_cost);
+
+    return schedule;
+}
+
+void schedule_destroy(TileSchedule schedule) {
+    free(schedule.tasks);
+}
+
+// Picks the tile size and order with the lowest simulated makespan. Larger
+// tiles and coherent orders come first and are only replaced by a
+// candidate that is more than 1% faster.
+TileSchedule schedule_tune(CostMap map, int width, int height, int samples, int threads, int tile_size, TileOrder order, int samples_per_task) {
+
+    static const int sizes[] = { 64, 32, 16, 8 };
+    static const TileOrder orders[] = { TILE_ORDER_HILBERT, TILE_ORDER_MORTON, TILE_ORDER_SCANLINE, TILE_ORDER_COST };
+
+    TileSchedule best = { .tasks = NULL };
+
+    for (int si = 0; si < 4; si++) {
+        if (tile_size > 0 && sizes[si] != tile_size) {
+            continue;
+        }
+        for (int oi = 0; oi < 4; oi++) {
+            if (order != TILE_ORDER_AUTO && orders[oi] != order) {
+                continue;
+            }
+            TileSchedule candidate = schedule_build(map, width, height, samples, threads, sizes[si], orders[oi], samples_per_task);
+            if (best.tasks == NULL || candidate.makespan < 0.99 * best.makespan) {
+                schedule_destroy(best);
+                best = candidate;
+            } else {
+                schedule_destroy(candidate);
+            }
+        }
+    }
+
+    // Tile sizes that are not a candidate are used as given.
+    if (best.tasks == NULL) {
+        best = schedule_build(map, width, height, samples, threads, tile_size, (order == TILE_ORDER_AUTO) ? TILE_ORDER_COST : order, samples_per_task);
+    }
+
+    return best;
+}
@@ -1,15 +1,47 @@
 #pragma once
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <math.h>
+#include <time.h>
 
 #define PI 3.1415926535897932385
 
+// Used by the render kernel templates so that their constant flags fold away in every variant.
+#if defined(__GNUC__)
+#define FORCE_INLINE static inline __attribute__((always_inline))
+#else
+#define FORCE_INLINE static inline
+#endif
+
 static const double DEG2RAD = PI / 180.0;
 static const double RAD2DEG = 180.0 / PI;
 
+// Per-thread xorshift64* state, so render threads never contend on rand().
+static _Thread_local uint64_t frand_state = 0x9E3779B97F4A7C15ull;
+
+void frand_seed(uint64_t seed) {
+    // splitmix64 finalizer, spreads nearby seeds apart and never yields 0 for the state.
+    seed += 0x9E3779B97F4A7C15ull;
+    seed = (seed ^ (seed >> 30)) * 0xBF58476D1CE4E5B9ull;
+    seed = (seed ^ (seed >> 27)) * 0x94D049BB133111EBull;
+    seed ^= seed >> 31;
+    frand_state = seed ? seed : 0x9E3779B97F4A7C15ull;
+}
+
 double frand(void) {
-    return rand() / (RAND_MAX + 1.0);
+    frand_state ^= frand_state >> 12;
+    frand_state ^= frand_state << 25;
+    frand_state ^= frand_state >> 27;
+    return ((frand_state * 0x2545F4914F6CDD1Dull) >> 11) * 0x1.0p-53;
+}
+
+int imin(int a, int b) {
+    return (a < b) ? a : b;
+}
+
+int imax(int a, int b) {
+    return (a > b) ? a : b;
 }
 
 double clamp(double x, double a, double b) {
@@ -29,4 +61,10 @@ double unlerp(double x, double a, double b) {
 
 double remap(double x, double a1, double b1, double a2, double b2) {
     return lerp(a2, b2, unlerp(x, a1, b1));
+}
+
+double clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
 }
\ No newline at end of file
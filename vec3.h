@@ -66,6 +66,10 @@ double vec3_len(vec3 v) {
     return sqrt(vec3_sqrlen(v));
 }
 
+double vec3_axis(vec3 v, int axis) {
+    return (axis == 0) ? v.x : (axis == 1) ? v.y : v.z;
+}
+
 vec3 vec3_all(double t) {
     return (vec3) { .x = t, .y = t, .z = t };
 }
@@ -75,6 +79,22 @@ bool vec3_nearzero(vec3 v) {
     return (fabs(v.x) < epsilon) && (fabs(v.y) < epsilon) && (fabs(v.z) < epsilon);
 }
 
+vec3 vec3_min(vec3 u, vec3 v) {
+    return (vec3) {
+        .x = fmin(u.x, v.x),
+        .y = fmin(u.y, v.y),
+        .z = fmin(u.z, v.z)
+    };
+}
+
+vec3 vec3_max(vec3 u, vec3 v) {
+    return (vec3) {
+        .x = fmax(u.x, v.x),
+        .y = fmax(u.y, v.y),
+        .z = fmax(u.z, v.z)
+    };
+}
+
 vec3 vec3_clamp(vec3 v, vec3 a, vec3 b) {
     return (vec3) {
         .x = clamp(v.x, a.x, b.x),